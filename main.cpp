@@ -5,304 +5,5210 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <cstring>
+#include <unistd.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 // SDL_Window *window;
 
 // lldb (print pow correctly): expr -l objective-c -- @import Darwin
 
-class GlobalSettings
+// Threads used by parallelFor, 0 for one per core. Rendered images don't depend on it.
+int parallelThreads = 0;
+
+int parallelThreadCount()
 {
-  public:
-  const static int ScreenResolutionX = 640;
-  const static int ScreenResolutionY = 480;
-};
+  return parallelThreads > 0 ? parallelThreads : std::max(1u, std::thread::hardware_concurrency());
+}
 
-struct Ray
+// Jobs of higher priority get the threads first, see ThreadPool.
+enum class JobPriority
 {
-  Eigen::Vector3d origin;
-  Eigen::Vector3d direction;
+  Background, // work ahead of time, e.g. posing the next frames of a sequence
+  Final,      // full quality frames
+  Preview     // quick frames someone is waiting for, e.g. while the view moves
 };
 
-class Object;
-
-struct RayHitResult
+// What the loops a thread runs are for. Set with JobScope, and inherited by the items of those
+// loops (which may run on other threads) and the loops they start in turn.
+struct JobContext
 {
-  Eigen::Vector3d hitPosition;
-  bool hit;
-  Object* hitObject;
+  JobPriority priority = JobPriority::Final;
+  const std::atomic<bool>* cancelled = nullptr; // once set, items not started yet are skipped
 };
 
-class Object
+thread_local JobContext currentJob;
+
+// Makes the current thread work for job until the scope ends.
+class JobScope
 {
+  JobContext previous;
+
   public:
-  Eigen::Vector3d color;
 
-  virtual RayHitResult raytrace(Ray ray) = 0;
-  virtual const Eigen::Vector3d normalAt(const Eigen::Vector3d pos) = 0;
+  JobScope(const JobContext& job)
+  {
+    previous = currentJob;
+    currentJob = job;
+  }
+
+  ~JobScope()
+  {
+    currentJob = previous;
+  }
 };
 
-class Sphere : public Object
+// The threads shared by all parallelFor loops. Items are handed out one at a time, always from
+// the loop of the highest priority (the oldest among equals), so a job of higher priority takes
+// over every thread as soon as they finish their current item (a tile, mostly), and a cancelled
+// job stops at its next one. The thread that runs a loop works on it too, which keeps nested
+// loops from waiting on threads that are all busy waiting themselves.
+class ThreadPool
 {
-  float radii;
-  Eigen::Vector3d position;
+  struct Loop
+  {
+    int next;
+    int end;
+    int pending; // items not finished yet
+    const std::function<void(int)>* body;
+    JobContext job;
+    unsigned long long order;
+  };
+
+  std::mutex mutex;
+  std::condition_variable available;
+  std::condition_variable finished;
+  std::vector<Loop*> loops; // those with items left to hand out
+  unsigned long long loopsStarted = 0;
+  bool stopping = false;
+  std::vector<std::thread> workers;
 
   public:
-  Sphere (double pRadii, Eigen::Vector3d pPosition, Eigen::Vector3d pColor)
+
+  ThreadPool(int threadCount)
   {
-    radii = pRadii; // in meters
-    position = pPosition;
-    color = pColor;
+    for (int i = 1; i < threadCount; ++i)
+    {
+      workers.emplace_back([this]() { work(); });
+    }
   }
 
-  virtual const Eigen::Vector3d normalAt(const Eigen::Vector3d pPos)
+  ~ThreadPool()
   {
-    return pPos - position;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      available.notify_all();
+    }
+    for (std::thread& worker : workers)
+    {
+      worker.join();
+    }
   }
 
-  virtual RayHitResult raytrace(Ray ray)
+  // Runs body(i) for every i in [begin, end) on the pool and returns once all are done, or
+  // skipped because the current job was cancelled.
+  void run(int begin, int end, const std::function<void(int)>& body)
   {
-    // print the closest colision point
-    // see equation at https://en.wikipedia.org/wiki/Line%E2%80%93sphere_intersection
-    // - (l * ( o - c) ) +- sqrt( (l * ( o - c))^2 - (o-c)^2 + r^2 )
-    double l_o_c =
-      ray.direction.x() * ( ray.origin.x() - position.x() ) +
-      ray.direction.y() * ( ray.origin.y() - position.y() ) +
-      ray.direction.z() * ( ray.origin.z() - position.z() );
-
-    double sqrtValue =
-      pow( l_o_c, 2)
-      - ( pow(ray.origin.x() - position.x(), 2) +
-          pow(ray.origin.y() - position.y(), 2) +
-          pow(ray.origin.z() - position.z(), 2)
-        )
-      + pow(radii, 2);
-
+    if (begin >= end)
+    {
+      return;
+    }
 
-    RayHitResult hitResult;
+    std::unique_lock<std::mutex> lock(mutex);
+    Loop loop = {begin, end, end - begin, &body, currentJob, loopsStarted++};
+    loops.push_back(&loop);
+    available.notify_all();
 
-    if (sqrtValue < 0)
+    while (loop.next < loop.end)
     {
-      hitResult.hit = false;
-
-      return hitResult; //  missed the sphere
+      runItem(loop, lock);
     }
-    else
+    finished.wait(lock, [&]() { return loop.pending == 0; });
+  }
+
+  private:
+
+  void work()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
     {
-      double t = - l_o_c - sqrtValue;
+      available.wait(lock, [&]() { return stopping || !loops.empty(); });
+      if (loops.empty())
+      {
+        return;
+      }
 
-      if (t < 0)
+      Loop* best = loops[0];
+      for (Loop* loop : loops)
       {
-        hitResult.hit = false;
-        return hitResult;
+        bool better = loop->job.priority > best->job.priority || (loop->job.priority == best->job.priority && loop->order < best->order);
+        if (better)
+        {
+          best = loop;
+        }
       }
+      runItem(*best, lock);
+    }
+  }
 
-      // ray equation
-      // R(t) = StartPos + Direction * t
-      Eigen::Vector3d hitPosition = ray.origin + ray.direction * t;
+  // Takes the next item of loop and runs it without holding the lock.
+  void runItem(Loop& loop, std::unique_lock<std::mutex>& lock)
+  {
+    int i = loop.next++;
+    if (loop.next == loop.end)
+    {
+      loops.erase(std::find(loops.begin(), loops.end(), &loop));
+    }
+    lock.unlock();
 
-      hitResult.hit = true;
-      hitResult.hitPosition = hitPosition;
-      return hitResult;
+    if (!loop.job.cancelled || !*loop.job.cancelled)
+    {
+      JobScope scope(loop.job);
+      (*loop.body)(i);
+    }
+
+    lock.lock();
+    if (--loop.pending == 0)
+    {
+      finished.notify_all();
     }
   }
 };
 
-struct Light
+ThreadPool& threadPool()
 {
-  Eigen::Vector3d pos;
-  Eigen::Vector3d color;
-  double intensity = 70;
-};
+  static ThreadPool pool(parallelThreadCount());
+  return pool;
+}
 
-class World
+// Runs body(i) for every i in [begin, end) on the shared threads, for the current job.
+template <typename Body>
+void parallelFor(int begin, int end, const Body& body)
 {
+  threadPool().run(begin, end, body);
+}
+
+// Picks index i with probability weights[i] / sum(weights) in O(1) (Vose's alias method):
+// every bucket holds one entry plus an alias, and a single random number selects the bucket
+// and which of its two entries to return. No CDF binary search.
+class AliasTable
+{
+  std::vector<double> probability; // chance of keeping bucket i instead of taking its alias
+  std::vector<int> alias;
+  std::vector<double> pdfs;
+
   public:
-  std::vector<Object*> sceneObjects;
-  Light light;
 
-  void spawnObject()
+  void build(const std::vector<double>& weights)
   {
-    light.pos = Eigen::Vector3d(0, -2, 0);
-    light.color = Eigen::Vector3d(255, 255, 255);
+    int n = weights.size();
+    probability.assign(n, 1);
+    alias.assign(n, 0);
+    pdfs.assign(n, 0);
 
-    sceneObjects.push_back(new Sphere(0.5, Eigen::Vector3d(0.5, 0.8, -8), Eigen::Vector3d(100, 100, 0)));
-    sceneObjects.push_back(new Sphere(0.5, Eigen::Vector3d(1.9, 0.3, -9.8), Eigen::Vector3d(0, 100, 0)));
-    sceneObjects.push_back(new Sphere(0.5, Eigen::Vector3d(0.9, 0.8, -7.5), Eigen::Vector3d(0, 100, 55)));
+    if (n == 0)
+    {
+      return;
+    }
+
+    // sum and normalise in parallel, only the pairing below is sequential
+    int chunkSize = 4096;
+    int chunks = (n + chunkSize - 1) / chunkSize;
+    std::vector<double> chunkSums(chunks, 0);
+    parallelFor(0, chunks, [&](int chunk)
+    {
+      for (int i = chunk * chunkSize; i < std::min(n, (chunk + 1) * chunkSize); ++i)
+      {
+        chunkSums[chunk] += weights[i];
+      }
+    });
+
+    double total = 0;
+    for (double chunkSum : chunkSums)
+    {
+      total += chunkSum;
+    }
+
+    if (total <= 0)
+    {
+      std::fill(pdfs.begin(), pdfs.end(), 1.0 / n);
+      return;
+    }
+
+    parallelFor(0, chunks, [&](int chunk)
+    {
+      for (int i = chunk * chunkSize; i < std::min(n, (chunk + 1) * chunkSize); ++i)
+      {
+        pdfs[i] = weights[i] / total;
+        probability[i] = pdfs[i] * n;
+      }
+    });
+
+    std::vector<int> small, large;
+    for (int i = 0; i < n; ++i)
+    {
+      (probability[i] < 1 ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty())
+    {
+      int less = small.back();
+      int more = large.back();
+      small.pop_back();
+
+      alias[less] = more;
+      probability[more] -= 1 - probability[less];
+
+      if (probability[more] < 1)
+      {
+        large.pop_back();
+        small.push_back(more);
+      }
+    }
+
+    // whatever is left is 1 up to rounding
+    for (int i : small) probability[i] = 1;
+    for (int i : large) probability[i] = 1;
   }
-};
 
-class Camera
-{
-  public:
-  Eigen::Vector3d pos;
-  Eigen::Vector3d dir;
-  double viewPlaceDist = -0.5;
-  double viewPlaneXsize;  // the size of the rendering place, in meters
-  double viewPlaneYsize;  // the size of the rendering place, in meters
+  // u in [0, 1). Returns the picked index and the probability it had.
+  int sample(double u, double& pdf) const
+  {
+    int n = probability.size();
+    double scaled = u * n;
+    int bucket = std::min(int(scaled), n - 1);
 
-  Camera(double pScreenWidth, double pScreenHeight)
+    int index = scaled - bucket < probability[bucket] ? bucket : alias[bucket];
+    pdf = pdfs[index];
+    return index;
+  }
+
+  double pdf(int index) const
   {
-    viewPlaneYsize = 0.1;
-    viewPlaneXsize = (pScreenWidth/pScreenHeight) * viewPlaneYsize;
+    return pdfs[index];
   }
 
-  Ray RayAtScreenSpace(double x, double y)
+  bool empty() const
   {
-    Ray ray;
+    return pdfs.empty();
+  }
+};
 
-    ray.origin = Eigen::Vector3d(0, 0, 0.5); // TODO change this to use the camera position
-    ray.direction = Eigen::Vector3d(x * viewPlaneXsize, y * viewPlaneYsize, viewPlaceDist);
-    ray.direction.normalize();
+// Low-discrepancy sampling. Sobol' points cover the sample space far more evenly than
+// independent random numbers, so the same noise level needs a fraction of the samples.
+//
+// The generator matrices of the first SobolDimensions dimensions are built at compile time from
+// the primitive polynomials and initial direction numbers of Joe & Kuo (new-joe-kuo-6.21201).
+// Dimension 0 is the van der Corput sequence.
+const int SobolDimensions = 16;
 
-    return ray;
-  }
+struct SobolParameters
+{
+  int degree;
+  unsigned int coefficients;
+  unsigned int initial[6];
 };
 
-class Renderer
+constexpr SobolParameters sobolParameters[SobolDimensions - 1] =
 {
-  public:
+  {1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}, {3, 2, {1, 1, 1}}, {4, 1, {1, 1, 3, 3}},
+  {4, 4, {1, 3, 5, 13}}, {5, 2, {1, 1, 5, 5, 17}}, {5, 4, {1, 1, 5, 5, 5}}, {5, 7, {1, 1, 7, 11, 19}},
+  {5, 11, {1, 1, 5, 1, 1}}, {5, 13, {1, 1, 1, 3, 11}}, {5, 14, {1, 3, 5, 5, 31}},
+  {6, 1, {1, 3, 3, 9, 7, 49}}, {6, 13, {1, 1, 1, 15, 21, 21}}, {6, 16, {1, 3, 1, 13, 27, 49}}
+};
 
-  SDL_Window *window;
-  int windowIndex;
-  SDL_Renderer* sdl_renderer;
+struct SobolMatrices
+{
+  unsigned int columns[SobolDimensions][32];
+};
 
-  World* world;
+constexpr SobolMatrices buildSobolMatrices()
+{
+  SobolMatrices matrices = {};
 
-  Renderer(SDL_Window *window, World *pWorld)
+  for (int bit = 0; bit < 32; ++bit)
   {
-    this->window = window;
-    world = pWorld;
-
-    windowIndex = -1; // the index of the rendering driver to initialize, or -1 to initialize the first one supporting the requested flags
-    int flags = 0;
-    sdl_renderer = SDL_CreateRenderer(window, windowIndex, flags);
+    matrices.columns[0][bit] = 1u << (31 - bit);
   }
 
-  void render()
+  for (int dimension = 1; dimension < SobolDimensions; ++dimension)
   {
-    SDL_SetRenderDrawColor(sdl_renderer, 255, 0, 0, 1); // If something is FULL red on the screen, it means that pixel was not rendered
-    SDL_RenderClear(sdl_renderer);
-    SDL_RenderPresent( sdl_renderer );
-
-    Camera camera(GlobalSettings::ScreenResolutionX, GlobalSettings::ScreenResolutionY);
+    const SobolParameters& parameters = sobolParameters[dimension - 1];
+    unsigned int* v = matrices.columns[dimension];
+    int s = parameters.degree;
 
-    double screenSpaceXRatio = 1.0 / GlobalSettings::ScreenResolutionX;
-    double screenSpaceYRatio = 1.0 / GlobalSettings::ScreenResolutionY;
+    for (int bit = 0; bit < s; ++bit)
+    {
+      v[bit] = parameters.initial[bit] << (31 - bit);
+    }
 
-    for (int y = 0; y < GlobalSettings::ScreenResolutionY; ++y)
+    for (int bit = s; bit < 32; ++bit)
     {
-      for (int x = 0; x < GlobalSettings::ScreenResolutionX; ++x)
+      v[bit] = v[bit - s] ^ (v[bit - s] >> s);
+      for (int k = 1; k < s; ++k)
       {
-        double screenSpaceX = screenSpaceXRatio * x;
-        double screenSpaceY = screenSpaceYRatio * y;
-        Ray ray = camera.RayAtScreenSpace(screenSpaceX, screenSpaceY);
-
-        RayHitResult hitResult = findClosestHit(world->sceneObjects, ray);
-
-        if (hitResult.hit)
-        {
-          // calculating pixel color (SHADER!)
-          Eigen::Vector3d normal = hitResult.hitObject->normalAt(hitResult.hitPosition);
-
-          Eigen::Vector3d lightNormalToHitPos = world->light.pos - hitResult.hitPosition;
-          double distanceFromLight = lightNormalToHitPos.norm();
-          double lightAttenuation = (1/ (1 + 0.1 * distanceFromLight + 0.1 * distanceFromLight * distanceFromLight ));
-
-          lightNormalToHitPos.normalize();
-          double lightAngle = lightNormalToHitPos.dot(normal);
-
-          if (lightAngle > 0)
-          {
-            int r = hitResult.hitObject->color.x() * lightAngle * lightAttenuation * world->light.intensity;
-            int g = hitResult.hitObject->color.y() * lightAngle * lightAttenuation * world->light.intensity;
-            int b = hitResult.hitObject->color.z() * lightAngle * lightAttenuation * world->light.intensity;
-            SDL_SetRenderDrawColor(sdl_renderer, r, g, b, 1);
-          }
-          else
-          {
-            SDL_SetRenderDrawColor(sdl_renderer, 0, 0, 0, 1);
-          }
-        }
-        else
+        if ((parameters.coefficients >> (s - 1 - k)) & 1)
         {
-          SDL_SetRenderDrawColor(sdl_renderer, 50, 50, 50, 1);
+          v[bit] ^= v[bit - k];
         }
-
-        SDL_RenderDrawPoint(sdl_renderer, x, y);
       }
     }
-
-    SDL_RenderPresent( sdl_renderer );
-    std::cout << "done" << std::endl;
   }
 
-  RayHitResult findClosestHit(std::vector<Object*> worldObjects, Ray ray)
-  {
-    RayHitResult closestHitResult;
-    closestHitResult.hitPosition = Eigen::Vector3d(9999, 9999, 9999);
-    closestHitResult.hit = false;
-    closestHitResult.hitObject = nullptr;
+  return matrices;
+}
 
-    for (int i = 0; i < worldObjects.size(); ++i)
+constexpr SobolMatrices sobolMatrices = buildSobolMatrices();
+
+// 32 bit fixed point Sobol' coordinate of point index in one dimension.
+unsigned int sobolSample(unsigned long long index, int dimension)
+{
+  unsigned int value = 0;
+  for (int bit = 0; index != 0 && bit < 32; index >>= 1, ++bit)
+  {
+    if (index & 1)
     {
-      Object* sceneObject = world->sceneObjects[i];
+      value ^= sobolMatrices.columns[dimension][bit];
+    }
+  }
+  return value;
+}
 
-      RayHitResult hitResult;
-      hitResult = sceneObject->raytrace(ray);
+unsigned int mixBits(unsigned int x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
 
-      if (hitResult.hit && hitResult.hitPosition.norm() < closestHitResult.hitPosition.norm())
-      {
-        closestHitResult = hitResult;
-        closestHitResult.hitObject = sceneObject;
-      }
-    }
+unsigned int hashCombine(unsigned int seed, unsigned int value)
+{
+  return mixBits(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
 
-    return closestHitResult;
-  }
-};
+unsigned int reverseBits(unsigned int x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
 
-void waitUntilQuit()
+// Owen scrambling with a hash (Laine & Karras 2011, Burley 2020): every bit is flipped based on
+// the bits above it, which randomises the points while keeping their stratification.
+unsigned int owenScramble(unsigned int x, unsigned int seed)
 {
-  // A basic main loop to prevent blocking
-  bool is_running = true;
-  SDL_Event event;
-  while (is_running) {
-      while (SDL_PollEvent(&event)) {
-          if (event.type == SDL_QUIT) {
-              is_running = false;
-          }
-      }
-      SDL_Delay(16);
-  }
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits(x);
 }
 
-int main(int argc, char* argv[])
+double fixedPointToUnit(unsigned int x)
 {
-  SDL_Init(SDL_INIT_VIDEO);
+  return std::min(x * 0x1p-32, 1 - std::numeric_limits<double>::epsilon());
+}
 
-  SDL_Window* window = SDL_CreateWindow(
-      "Raytracer",
-      SDL_WINDOWPOS_CENTERED,
-      SDL_WINDOWPOS_CENTERED,
-      GlobalSettings::ScreenResolutionX,
-      GlobalSettings::ScreenResolutionY,
-      SDL_WINDOW_MAXIMIZED | SDL_WINDOW_SHOWN
-  );
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011): ten rounds of multiplies
+// and xors turn a 128 bit counter and a 64 bit key into four random 32 bit words. There is no
+// generator state, so the numbers of a (pixel, sample, dimension) counter are the same
+// whichever thread asks for them, and in whatever order.
+//
+// Lanes counters are processed side by side. Every step is the same operation on all lanes,
+// which the compiler turns into one SIMD instruction each (8 lanes fill an AVX2 register).
+const int PhiloxLanes = 8;
 
-  if (window == NULL)
+template <int Lanes>
+void philox4x32(unsigned int (&x)[4][Lanes], unsigned int key0, unsigned int key1)
+{
+  for (int round = 0; round < 10; ++round)
   {
-      printf("Could not create window: %s\n", SDL_GetError());
-      return 1;
+    for (int lane = 0; lane < Lanes; ++lane)
+    {
+      unsigned long long product0 = 0xd2511f53ull * x[0][lane];
+      unsigned long long product1 = 0xcd9e8d57ull * x[2][lane];
+      unsigned int y0 = (unsigned int)(product1 >> 32) ^ x[1][lane] ^ key0;
+      unsigned int y2 = (unsigned int)(product0 >> 32) ^ x[3][lane] ^ key1;
+      x[0][lane] = y0;
+      x[1][lane] = (unsigned int)product1;
+      x[2][lane] = y2;
+      x[3][lane] = (unsigned int)product0;
+    }
+
+    key0 += 0x9e3779b9u;
+    key1 += 0xbb67ae85u;
   }
+}
 
-  SDL_Delay(1);
+enum class SamplerType
+{
+  Independent, // uncorrelated random numbers from Philox
+  Sobol,       // Owen-scrambled Sobol', padded with freshly shuffled copies past SobolDimensions
+  BlueNoise    // Owen-scrambled Sobol' over pixels in Morton order, which spreads the error as
+               // blue noise across neighbouring pixels (Ahmed & Wonka 2020)
+};
 
-  World world;
-  world.spawnObject();
+// Random numbers for one sample of one pixel. Every get1D / get2D uses up the next dimensions,
+// and the values only depend on (pixel, sample index, dimension), never on thread timing.
+class Sampler
+{
+  // The blue noise sampler scrambles per dimension only, pixels are decorrelated by the index.
+  static const unsigned int BlueNoiseSeed = 0x68e31da4u;
+  static const unsigned int PhiloxKey0 = 0x2545f491u;
+  static const unsigned int PhiloxKey1 = 0x9a3f1c07u;
 
-  Renderer render(window, &world);
-  render.render();
+  SamplerType type;
+  int log2SamplesPerPixel;
+  int base4Digits;
 
-  waitUntilQuit();
+  int pixelX;
+  int pixelY;
+  unsigned int pixelSeed;
+  unsigned long long mortonIndex;
+  int sampleIndex;
+  int dimension;
+
+  public:
+
+  // samplesPerPixel and resolution (the larger side of the image) size the BlueNoise ordering.
+  Sampler(SamplerType pType, int samplesPerPixel, int resolution)
+  {
+    type = pType;
+
+    log2SamplesPerPixel = 0;
+    while ((1 << log2SamplesPerPixel) < samplesPerPixel)
+    {
+      log2SamplesPerPixel++;
+    }
+
+    int log2Resolution = 0;
+    while ((1 << log2Resolution) < resolution)
+    {
+      log2Resolution++;
+    }
+    base4Digits = log2Resolution + (log2SamplesPerPixel + 1) / 2;
+  }
+
+  void startPixelSample(int x, int y, int pSampleIndex, int pDimension = 0)
+  {
+    pixelX = x;
+    pixelY = y;
+    pixelSeed = hashCombine(hashCombine(0, x), y);
+    mortonIndex = (mortonCode(x, y) << log2SamplesPerPixel) | pSampleIndex;
+    sampleIndex = pSampleIndex;
+    dimension = pDimension;
+  }
+
+  double get1D()
+  {
+    double value;
+
+    if (type == SamplerType::Sobol)
+    {
+      value = fixedPointToUnit(scrambledSobol(dimension));
+    }
+    else if (type == SamplerType::BlueNoise)
+    {
+      value = fixedPointToUnit(owenScramble(sobolSample(blueNoiseIndex(), 0), hashCombine(BlueNoiseSeed, dimension)));
+    }
+    else
+    {
+      unsigned int x[4][1] = {{(unsigned int)pixelX}, {(unsigned int)pixelY}, {(unsigned int)sampleIndex}, {(unsigned int)dimension / 4}};
+      philox4x32(x, PhiloxKey0, PhiloxKey1);
+      value = fixedPointToUnit(x[dimension % 4][0]);
+    }
+
+    dimension++;
+    return value;
+  }
+
+  Eigen::Vector2d get2D()
+  {
+    if (type == SamplerType::Sobol && dimension % SobolDimensions == SobolDimensions - 1)
+    {
+      dimension++; // keep both coordinates in the same block of dimensions, they are stratified together
+    }
+
+    if (type == SamplerType::BlueNoise)
+    {
+      unsigned long long index = blueNoiseIndex();
+      unsigned int seed = hashCombine(BlueNoiseSeed, dimension);
+      dimension += 2;
+      return Eigen::Vector2d(
+        fixedPointToUnit(owenScramble(sobolSample(index, 0), seed)),
+        fixedPointToUnit(owenScramble(sobolSample(index, 1), mixBits(seed))));
+    }
+
+    double u1 = get1D();
+    double u2 = get1D();
+    return Eigen::Vector2d(u1, u2);
+  }
+
+  // The values get1D returns after startPixelSample(x + i, y, sampleIndex, dimension), for the
+  // count pixels of a row starting at (x, y). Independent numbers are generated PhiloxLanes
+  // pixels at a time.
+  void get1DRow(int x, int y, int pSampleIndex, int pDimension, int count, double* values)
+  {
+    if (type != SamplerType::Independent)
+    {
+      for (int i = 0; i < count; ++i)
+      {
+        startPixelSample(x + i, y, pSampleIndex, pDimension);
+        values[i] = get1D();
+      }
+      return;
+    }
+
+    for (int first = 0; first < count; first += PhiloxLanes)
+    {
+      unsigned int counter[4][PhiloxLanes];
+      for (int lane = 0; lane < PhiloxLanes; ++lane)
+      {
+        counter[0][lane] = x + first + lane;
+        counter[1][lane] = y;
+        counter[2][lane] = pSampleIndex;
+        counter[3][lane] = pDimension / 4;
+      }
+
+      philox4x32(counter, PhiloxKey0, PhiloxKey1);
+
+      for (int lane = 0; lane < PhiloxLanes && first + lane < count; ++lane)
+      {
+        values[first + lane] = fixedPointToUnit(counter[pDimension % 4][lane]);
+      }
+    }
+  }
+
+  // The same for get2D.
+  void get2DRow(int x, int y, int pSampleIndex, int pDimension, int count, double* values1, double* values2)
+  {
+    if (type == SamplerType::Independent)
+    {
+      get1DRow(x, y, pSampleIndex, pDimension, count, values1);
+      get1DRow(x, y, pSampleIndex, pDimension + 1, count, values2);
+      return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+      startPixelSample(x + i, y, pSampleIndex, pDimension);
+      Eigen::Vector2d u = get2D();
+      values1[i] = u.x();
+      values2[i] = u.y();
+    }
+  }
+
+  private:
+
+  // Sobol': the sample index is shuffled per pixel (by Owen scrambling it) and per block of
+  // SobolDimensions dimensions, so that blocks don't correlate with each other or with neighbours.
+  unsigned int scrambledSobol(int d)
+  {
+    int block = d / SobolDimensions;
+    unsigned int shuffledIndex = owenScramble(sampleIndex, hashCombine(pixelSeed, block));
+    return owenScramble(sobolSample(shuffledIndex, d % SobolDimensions), hashCombine(pixelSeed, d + 0x51ed270bu));
+  }
+
+  static unsigned long long mortonCode(unsigned int x, unsigned int y)
+  {
+    unsigned long long code = 0;
+    for (int bit = 0; bit < 32; ++bit)
+    {
+      code |= (unsigned long long)((x >> bit) & 1) << (2 * bit);
+      code |= (unsigned long long)((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return code;
+  }
+
+  // Sobol' index of this pixel sample: the Morton index with each base 4 digit permuted by a
+  // hash of the digits above it, so that each 2x2 block of pixels (and each block of blocks)
+  // shares one well stratified set of points (the ZSobol sampler of pbrt-v4).
+  unsigned long long blueNoiseIndex() const
+  {
+    static const unsigned char permutations[24][4] =
+    {
+      {0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+      {1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+      {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+      {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2}
+    };
+
+    unsigned long long index = 0;
+    bool oddPower = log2SamplesPerPixel & 1;
+    int lastDigit = oddPower ? 1 : 0;
+
+    for (int digit = base4Digits - 1; digit >= lastDigit; --digit)
+    {
+      int shift = 2 * digit - (oddPower ? 1 : 0);
+      int value = (mortonIndex >> shift) & 3;
+      unsigned long long higherDigits = mortonIndex >> (shift + 2);
+      int permutation = mixBits((unsigned int)(higherDigits ^ (higherDigits >> 32)) ^ (0x55555555u * dimension)) % 24;
+      index |= (unsigned long long)permutations[permutation][value] << shift;
+    }
+
+    if (oddPower)
+    {
+      int value = mortonIndex & 1;
+      index |= value ^ (mixBits((unsigned int)(mortonIndex >> 1) ^ (0x55555555u * dimension)) & 1);
+    }
+
+    return index;
+  }
+};
+
+struct Ray
+{
+  Eigen::Vector3d origin;
+  Eigen::Vector3d direction;
+};
+
+class Object;
+
+struct RayHitResult
+{
+  Eigen::Vector3d hitPosition;
+  double distance; // along the ray, from its origin
+  bool hit;
+  Object* hitObject;
+  int objectId; // index in World::sceneObjects
+};
+
+class Object
+{
+  public:
+  Eigen::Vector3d color;
+
+  virtual ~Object() {}
+
+  virtual RayHitResult raytrace(Ray ray) = 0;
+  virtual const Eigen::Vector3d normalAt(const Eigen::Vector3d pos) = 0;
+
+  // Moves the object from where it was created: rotated around the origin, then translated.
+  virtual void setTransform(const Eigen::Vector3d& translation, const Eigen::Quaterniond& rotation) = 0;
+
+  virtual Object* clone() const = 0;
+};
+
+class Sphere : public Object
+{
+  float radii;
+  Eigen::Vector3d position;
+  Eigen::Vector3d restPosition; // where it was created
+
+  public:
+  Sphere (double pRadii, Eigen::Vector3d pPosition, Eigen::Vector3d pColor)
+  {
+    radii = pRadii; // in meters
+    position = pPosition;
+    restPosition = pPosition;
+    color = pColor;
+  }
+
+  virtual void setTransform(const Eigen::Vector3d& translation, const Eigen::Quaterniond& rotation)
+  {
+    position = rotation * restPosition + translation;
+  }
+
+  virtual Object* clone() const
+  {
+    return new Sphere(*this);
+  }
+
+  virtual const Eigen::Vector3d normalAt(const Eigen::Vector3d pPos)
+  {
+    return pPos - position;
+  }
+
+  virtual RayHitResult raytrace(Ray ray)
+  {
+    // print the closest colision point
+    // see equation at https://en.wikipedia.org/wiki/Line%E2%80%93sphere_intersection
+    // - (l * ( o - c) ) +- sqrt( (l * ( o - c))^2 - (o-c)^2 + r^2 )
+    double l_o_c =
+      ray.direction.x() * ( ray.origin.x() - position.x() ) +
+      ray.direction.y() * ( ray.origin.y() - position.y() ) +
+      ray.direction.z() * ( ray.origin.z() - position.z() );
+
+    double sqrtValue =
+      pow( l_o_c, 2)
+      - ( pow(ray.origin.x() - position.x(), 2) +
+          pow(ray.origin.y() - position.y(), 2) +
+          pow(ray.origin.z() - position.z(), 2)
+        )
+      + pow(radii, 2);
+
+
+    RayHitResult hitResult;
+
+    if (sqrtValue < 0)
+    {
+      hitResult.hit = false;
+
+      return hitResult; //  missed the sphere
+    }
+    else
+    {
+      double t = - l_o_c - sqrt(sqrtValue);
+
+      if (t < 0)
+      {
+        hitResult.hit = false;
+        return hitResult;
+      }
+
+      // ray equation
+      // R(t) = StartPos + Direction * t
+      Eigen::Vector3d hitPosition = ray.origin + ray.direction * t;
+
+      hitResult.hit = true;
+      hitResult.hitPosition = hitPosition;
+      hitResult.distance = t;
+      return hitResult;
+    }
+  }
+};
+
+template <typename T>
+T lightAttenuation(const T& distance)
+{
+  return 1 / (1 + 0.1 * distance + 0.1 * distance * distance);
+}
+
+struct Light
+{
+  Eigen::Vector3d pos;
+  Eigen::Vector3d color;
+  double intensity = 70;
+  double radius = 0; // 0 for a point light, otherwise a spherical area light
+
+  double power() const
+  {
+    return intensity * color.mean() / 255;
+  }
+
+  // A point on the light's surface for the given pair of random numbers in [0, 1).
+  Eigen::Vector3d samplePosition(double u1, double u2) const
+  {
+    if (radius <= 0)
+    {
+      return pos;
+    }
+
+    double z = 1 - 2 * u1;
+    double r = sqrt(std::max(0.0, 1 - z * z));
+    double phi = 2 * M_PI * u2;
+    return pos + radius * Eigen::Vector3d(r * cos(phi), r * sin(phi), z);
+  }
+};
+
+// Bounding volume hierarchy over the lights. Every node knows the bounds and total power of
+// the lights below it, so a shading point can walk down the tree picking the child that is
+// likely to contribute the most, and reach one light in O(log n) instead of looking at all.
+class LightBVH
+{
+  struct Node
+  {
+    Eigen::AlignedBox3d bounds;
+    double power;
+    int left;
+    int right;
+    int lightIndex; // leaf only, -1 for inner nodes
+  };
+
+  std::vector<Node> nodes;
+
+  public:
+
+  void build(const std::vector<Light>& lights)
+  {
+    nodes.clear();
+    if (lights.empty())
+    {
+      return;
+    }
+
+    std::vector<int> lightIndices(lights.size());
+    for (int i = 0; i < int(lightIndices.size()); ++i)
+    {
+      lightIndices[i] = i;
+    }
+
+    nodes.reserve(2 * lights.size());
+    buildNode(lights, lightIndices, 0, lightIndices.size());
+  }
+
+  // Picks a light for the shading point p with normal n using the random number u in [0, 1).
+  // Returns its index in the light list (or -1 without lights) and the probability it was picked with.
+  int sample(const Eigen::Vector3d& p, const Eigen::Vector3d& n, double u, double& pdf) const
+  {
+    pdf = 0;
+    if (nodes.empty())
+    {
+      return -1;
+    }
+
+    pdf = 1;
+    int node = 0;
+
+    while (nodes[node].lightIndex < 0)
+    {
+      const Node& left = nodes[nodes[node].left];
+      const Node& right = nodes[nodes[node].right];
+
+      double leftImportance = importance(left, p, n);
+      double rightImportance = importance(right, p, n);
+      if (leftImportance + rightImportance <= 0)
+      {
+        // nothing below can light p, any choice is as good as another
+        leftImportance = rightImportance = 1;
+      }
+
+      double leftProbability = leftImportance / (leftImportance + rightImportance);
+
+      // reuse u for the next level by rescaling it into [0, 1)
+      if (u < leftProbability)
+      {
+        node = nodes[node].left;
+        pdf *= leftProbability;
+        u = u / leftProbability;
+      }
+      else
+      {
+        node = nodes[node].right;
+        pdf *= 1 - leftProbability;
+        u = (u - leftProbability) / (1 - leftProbability);
+      }
+      u = std::min(u, 1 - std::numeric_limits<double>::epsilon());
+    }
+
+    return nodes[node].lightIndex;
+  }
+
+  private:
+
+  int buildNode(const std::vector<Light>& lights, std::vector<int>& lightIndices, int begin, int end)
+  {
+    int nodeIndex = nodes.size();
+    nodes.push_back(Node());
+
+    Node node;
+    node.power = 0;
+    node.left = node.right = node.lightIndex = -1;
+
+    Eigen::AlignedBox3d centers;
+    for (int i = begin; i < end; ++i)
+    {
+      const Light& light = lights[lightIndices[i]];
+      node.bounds.extend(light.pos - Eigen::Vector3d::Constant(light.radius));
+      node.bounds.extend(light.pos + Eigen::Vector3d::Constant(light.radius));
+      node.power += light.power();
+      centers.extend(light.pos);
+    }
+
+    if (end - begin == 1)
+    {
+      node.lightIndex = lightIndices[begin];
+    }
+    else
+    {
+      // split at the median of the widest axis
+      int axis;
+      centers.sizes().maxCoeff(&axis);
+      int middle = (begin + end) / 2;
+      std::nth_element(lightIndices.begin() + begin, lightIndices.begin() + middle, lightIndices.begin() + end,
+        [&](int a, int b) { return lights[a].pos(axis) < lights[b].pos(axis); });
+
+      node.left = buildNode(lights, lightIndices, begin, middle);
+      node.right = buildNode(lights, lightIndices, middle, end);
+    }
+
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+  }
+
+  // Upper bound of what the lights in the node can contribute at p: all of their power at the
+  // closest distance the bounds allow, or nothing if the bounds are entirely behind the surface.
+  double importance(const Node& node, const Eigen::Vector3d& p, const Eigen::Vector3d& n) const
+  {
+    Eigen::Vector3d toCenter = node.bounds.center() - p;
+    Eigen::Vector3d halfSize = node.bounds.sizes() / 2;
+
+    if (toCenter.dot(n) + halfSize.dot(n.cwiseAbs()) <= 0)
+    {
+      return 0;
+    }
+
+    double closestDistance = std::max(0.0, toCenter.norm() - halfSize.norm());
+    return node.power * lightAttenuation(closestDistance);
+  }
+};
+
+// HDR light coming from every direction that doesn't hit an object, stored as a latitude-longitude
+// image. Up is -y, like the rest of the scene.
+class EnvironmentMap
+{
+  public:
+  int width = 0;
+  int height = 0;
+  Eigen::ArrayX3d radiance; // one row per pixel, top row first
+  AliasTable table;         // picks pixels by luminance, for importance sampling
+
+  // Reads a colour PFM (portable float map) file.
+  bool load(const std::string& path)
+  {
+    std::ifstream file(path, std::ios::binary);
+    std::string format;
+    double scale;
+    file >> format >> width >> height >> scale;
+    file.get(); // single whitespace before the pixel data
+
+    if (!file || format != "PF" || width <= 0 || height <= 0)
+    {
+      return false;
+    }
+
+    std::vector<float> pixels(width * height * 3);
+    file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(float));
+    if (!file)
+    {
+      return false;
+    }
+
+    bool bigEndian = scale > 0; // a negative scale means little-endian data
+    radiance.resize(width * height, 3);
+    for (int y = 0; y < height; ++y)
+    {
+      for (int x = 0; x < width; ++x)
+      {
+        for (int c = 0; c < 3; ++c)
+        {
+          // PFM stores the bottom row first
+          float value = pixels[((height - 1 - y) * width + x) * 3 + c];
+          if (bigEndian)
+          {
+            char* bytes = reinterpret_cast<char*>(&value);
+            std::reverse(bytes, bytes + sizeof(float));
+          }
+          radiance(y * width + x, c) = value * std::abs(scale);
+        }
+      }
+    }
+
+    buildSamplingTable();
+    return true;
+  }
+
+  Eigen::Vector3d lookup(const Eigen::Vector3d& direction) const
+  {
+    double theta = acos(std::max(-1.0, std::min(1.0, -direction.y())));
+    double phi = atan2(direction.z(), direction.x());
+
+    int x = std::min(width - 1, int((phi / (2 * M_PI) + 0.5) * width));
+    int y = std::min(height - 1, int(theta / M_PI * height));
+    return radiance.row(y * width + x).transpose();
+  }
+
+  // pdf per solid angle of sample() returning this direction
+  double pdf(const Eigen::Vector3d& direction) const
+  {
+    double theta = acos(std::max(-1.0, std::min(1.0, -direction.y())));
+    double phi = atan2(direction.z(), direction.x());
+
+    int x = std::min(width - 1, int((phi / (2 * M_PI) + 0.5) * width));
+    int y = std::min(height - 1, int(theta / M_PI * height));
+    double sinTheta = sin(theta);
+    return sinTheta > 0 ? table.pdf(y * width + x) * width * height / (2 * M_PI * M_PI * sinTheta) : 0;
+  }
+
+  // A direction picked in proportion to the light coming from it, and its pdf per solid angle.
+  Eigen::Vector3d sample(double u1, double u2, double u3, double& pdf) const
+  {
+    double pixelPdf;
+    int pixel = table.sample(u1, pixelPdf);
+
+    double theta = (pixel / width + u2) / height * M_PI;
+    double phi = ((pixel % width + u3) / width - 0.5) * 2 * M_PI;
+
+    // the table works in pixels, which cover less solid angle towards the poles
+    double sinTheta = sin(theta);
+    pdf = sinTheta > 0 ? pixelPdf * width * height / (2 * M_PI * M_PI * sinTheta) : 0;
+
+    return Eigen::Vector3d(sinTheta * cos(phi), -cos(theta), sinTheta * sin(phi));
+  }
+
+  private:
+
+  void buildSamplingTable()
+  {
+    std::vector<double> weights(width * height);
+    parallelFor(0, height, [&](int y)
+    {
+      double sinTheta = sin((y + 0.5) / height * M_PI);
+      for (int x = 0; x < width; ++x)
+      {
+        int i = y * width + x;
+        weights[i] = (0.2126 * radiance(i, 0) + 0.7152 * radiance(i, 1) + 0.0722 * radiance(i, 2)) * sinTheta;
+      }
+    });
+
+    table.build(weights);
+  }
+};
+
+class World
+{
+  public:
+  std::vector<Object*> sceneObjects;
+  std::vector<Light> lights;
+  EnvironmentMap* environment = nullptr; // without one, rays that miss everything see a flat grey
+  int geometryVersion = 0; // bump whenever objects are added, moved or removed, so cached hits get re-traced
+  int lightsVersion = 0;   // bump whenever lights change, so reused shading gets redone
+
+  // A copy with its own objects, which can be moved without affecting this world. The
+  // environment map is shared.
+  World* clone() const
+  {
+    World* copy = new World(*this);
+    for (Object*& object : copy->sceneObjects)
+    {
+      object = object->clone();
+    }
+    return copy;
+  }
+
+  void spawnObject()
+  {
+    Light light;
+    light.pos = Eigen::Vector3d(0, -2, 0);
+    light.color = Eigen::Vector3d(255, 255, 255);
+    lights.push_back(light);
+
+    sceneObjects.push_back(new Sphere(0.5, Eigen::Vector3d(0.5, 0.8, -8), Eigen::Vector3d(100, 100, 0)));
+    sceneObjects.push_back(new Sphere(0.5, Eigen::Vector3d(1.9, 0.3, -9.8), Eigen::Vector3d(0, 100, 0)));
+    sceneObjects.push_back(new Sphere(0.5, Eigen::Vector3d(0.9, 0.8, -7.5), Eigen::Vector3d(0, 100, 55)));
+    geometryVersion++;
+  }
+
+  RayHitResult findClosestHit(const Ray& ray)
+  {
+    RayHitResult closestHitResult;
+    closestHitResult.hitPosition = Eigen::Vector3d(9999, 9999, 9999);
+    closestHitResult.distance = std::numeric_limits<double>::infinity();
+    closestHitResult.hit = false;
+    closestHitResult.hitObject = nullptr;
+    closestHitResult.objectId = -1;
+
+    for (int i = 0; i < sceneObjects.size(); ++i)
+    {
+      Object* sceneObject = sceneObjects[i];
+
+      RayHitResult hitResult;
+      hitResult = sceneObject->raytrace(ray);
+
+      if (hitResult.hit && hitResult.distance < closestHitResult.distance)
+      {
+        closestHitResult = hitResult;
+        closestHitResult.hitObject = sceneObject;
+        closestHitResult.objectId = i;
+      }
+    }
+
+    return closestHitResult;
+  }
+
+  // Whether any object blocks the segment between two points.
+  bool isOccluded(const Eigen::Vector3d& from, const Eigen::Vector3d& to)
+  {
+    const double epsilon = 1e-6; // keeps the ray from hitting the surface it starts on
+
+    Ray ray;
+    ray.direction = to - from;
+    double distance = ray.direction.norm();
+    ray.direction /= distance;
+    ray.origin = from + ray.direction * epsilon;
+
+    for (Object* sceneObject : sceneObjects)
+    {
+      RayHitResult hitResult = sceneObject->raytrace(ray);
+
+      if (hitResult.hit && hitResult.distance < distance - epsilon)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Scatters small coloured point and area lights around the spheres, sharing the power of
+  // one default light, to exercise many-light sampling.
+  void spawnLights(int count)
+  {
+    std::mt19937 rng(count);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    for (int i = 0; i < count; ++i)
+    {
+      Light light;
+      light.pos = Eigen::Vector3d(-2 + 6 * uniform(rng), -3 + 5 * uniform(rng), -12 + 8 * uniform(rng));
+      light.color = Eigen::Vector3d(155 + 100 * uniform(rng), 155 + 100 * uniform(rng), 155 + 100 * uniform(rng));
+      light.intensity = 2 * light.intensity / count;
+      light.radius = i % 2 ? 0.1 : 0;
+      lights.push_back(light);
+    }
+  }
+};
+
+enum class LightSampler
+{
+  Tree,  // LightBVH, accounts for distance and orientation
+  Power  // alias table over light power, O(1) per sample but blind to position
+};
+
+enum class IntegratorType
+{
+  Direct,     // one bounce: lights and environment seen directly from the primary hits
+  PathTracer  // reflections and indirect light, see PathTracer
+};
+
+enum class ToneMap
+{
+  Clamp,    // values above 1 are cut off
+  Reinhard, // x / (1 + x), keeps detail in highlights
+  ACES      // filmic curve fitted to the ACES reference transform (Narkowicz 2015)
+};
+
+// File formats of the frames ImageEncoder saves.
+enum class ImageFormat
+{
+  Ppm, // 8 bit display pixels
+  Png, // 8 bit display pixels, stored without compression
+  Exr  // linear HDR colour, before exposure and tone mapping
+};
+
+enum class VideoFormat
+{
+  Y4m, // YUV4MPEG2, 4:4:4, BT.601 limited range
+  Rgb  // raw 8 bit RGB frames without any header
+};
+
+// How SequenceRenderer spreads frames over the threads.
+enum class FrameScheduling
+{
+  Auto,   // Frames if the first frame is cheap, otherwise Tiles
+  Tiles,  // one frame at a time, its tiles in parallel
+  Frames, // one frame per thread
+  Hybrid  // RenderSettings::framesInFlight frames at a time, all their tiles in parallel
+};
+
+// Arbitrary output variables: surface data of the primary hits, written next to the beauty image.
+enum class Aov
+{
+  Depth,    // distance along the primary ray, infinity on a miss
+  Normal,   // unit surface normal, zero on a miss
+  ObjectId, // index in World::sceneObjects, -1 on a miss
+  Albedo,   // surface colour, 1 is white, zero on a miss
+  Count
+};
+
+const char* aovNames[int(Aov::Count)] = {"depth", "normal", "objectid", "albedo"};
+
+// Samples per pixel a tile may take under --time-budget without --spp.
+const int BudgetSamplesPerPixel = 1024;
+
+// Settings that can change from one run to the next, set from the command line.
+struct RenderSettings
+{
+  int width = 640;  // of the image, in pixels
+  int height = 480;
+  int lightSamples = 1; // lights sampled per pixel; scenes with this many lights or fewer evaluate all of them
+  LightSampler lightSampler = LightSampler::Tree;
+  IntegratorType integrator = IntegratorType::Direct;
+  SamplerType sampler = SamplerType::Sobol;
+  int samplesPerPixel = 1;      // samples per pixel, or the most a tile may take with adaptive sampling
+  double adaptiveThreshold = 0; // relative error at which a tile stops sampling, 0 to sample every pixel samplesPerPixel times
+  int timeBudgetMs = 0;         // per full quality frame, or streamed image, from its start to its last pass; 0 for no limit, see parseArguments
+  int tileSize = 32;
+  int maxDepth = 5;             // path vertices, 1 is direct light only
+  int russianRouletteDepth = 3; // vertices before paths may be terminated early
+  double exposure = 0;  // in stops, applied before tone mapping
+  ToneMap toneMap = ToneMap::Clamp;
+  bool srgbOutput = false; // encode for an sRGB display, otherwise written as is (the look the scenes were made with)
+  bool dither = false;     // add noise below one 8 bit step to break up banding
+  int frameBudgetMs = 33;  // while the view keeps changing, renders restart at most this often
+  bool dynamicResolution = true; // and they lower their resolution to fit in frameBudgetMs, see Renderer::renderMotionFrame
+  bool reprojection = true;      // and reuse the last frame's shading where they can (only with dynamicResolution), see Renderer::reprojectMotionFrame
+  bool vsync = false;      // present in step with the display's refresh, which never holds up rendering
+  bool progressive = true; // show coarse previews while the primary hits are traced, see Renderer::render
+  int denoisePasses = 0;   // a-trous passes of the Denoiser after sampling, 0 to skip it
+  bool halfFloat = false;  // store full screen buffers as 16 bit floats, half the memory and bandwidth
+  int sceneLights = 0;  // extra lights added by World::spawnLights
+  std::string environmentPath;
+  std::string streamPath; // render straight to this tiled EXR file instead of a window, see streamToFile
+  std::vector<Aov> aovs;  // written to aovPrefix_<name>.pfm after every trace pass
+  std::string aovPrefix = "aov";
+  std::string savePrefix; // write every presented frame to savePrefix_<frame number>, see ImageEncoder
+  ImageFormat saveFormat = ImageFormat::Ppm;
+  int encoderThreads = 1;
+  int encodeQueueSize = 2; // frames waiting for an encoder before rendering waits for them
+  std::string videoPath;   // stream every presented frame to this file, pipe or "-" for stdout, see VideoSink
+  VideoFormat videoFormat = VideoFormat::Y4m;
+  int videoFrameRate = 30;
+  int frames = 0;            // render and save this many frames of an animation instead of a still, see SequenceRenderer
+  std::string animationPath; // its keyframes, see Animation::load; Animation::demo without one
+  FrameScheduling frameScheduling = FrameScheduling::Auto;
+  int framesInFlight = 2;      // with FrameScheduling::Hybrid
+  int sequenceMemoryMB = 1024; // most memory for the frames in flight, which caps their number in every mode
+};
+
+class Camera
+{
+  public:
+  Eigen::Vector3d pos = Eigen::Vector3d(0, 0, 0.5);
+  Eigen::Quaterniond orientation = Eigen::Quaterniond::Identity(); // looks down -Z without rotation
+  double viewPlaceDist = -0.5;
+  double viewPlaneXsize;  // the size of the rendering place, in meters
+  double viewPlaneYsize;  // the size of the rendering place, in meters
+
+  Camera(double pScreenWidth, double pScreenHeight)
+  {
+    viewPlaneYsize = 0.1;
+    viewPlaneXsize = (pScreenWidth/pScreenHeight) * viewPlaneYsize;
+  }
+
+  // Where the ray through point goes through the screen, in the coordinates of RayAtScreenSpace.
+  // Returns false for points behind the camera.
+  bool project(const Eigen::Vector3d& point, Eigen::Vector2d& screen) const
+  {
+    Eigen::Vector3d local = orientation.conjugate() * (point - pos);
+    if (local.z() >= 0)
+    {
+      return false;
+    }
+
+    double scale = viewPlaceDist / local.z();
+    screen = Eigen::Vector2d(local.x() * scale / viewPlaneXsize, local.y() * scale / viewPlaneYsize);
+    return true;
+  }
+
+  // Moves the camera by offset, given in the camera's frame: x to the right, y down and z backwards.
+  void move(const Eigen::Vector3d& offset)
+  {
+    pos += orientation * offset;
+  }
+
+  // Turns the camera around the world's vertical axis (yaw) and its own horizontal one (pitch).
+  void turn(double yawDegrees, double pitchDegrees)
+  {
+    orientation =
+      Eigen::AngleAxisd(yawDegrees * M_PI / 180, Eigen::Vector3d::UnitY()) *
+      orientation *
+      Eigen::AngleAxisd(pitchDegrees * M_PI / 180, Eigen::Vector3d::UnitX());
+    orientation.normalize();
+  }
+
+  Ray RayAtScreenSpace(double x, double y)
+  {
+    Ray ray;
+
+    ray.origin = pos;
+    ray.direction = orientation * Eigen::Vector3d(x * viewPlaneXsize, y * viewPlaneYsize, viewPlaceDist);
+    ray.direction.normalize();
+
+    return ray;
+  }
+};
+
+// Primary hit data for every pixel of one tile of the screen, written by the trace pass and
+// read by the shading pass. Each channel is stored as its own column (x values, then y, then z)
+// so the shading pass can work on many pixels at once instead of one pixel at a time.
+struct GBuffer
+{
+  int originX; // screen position of the tile's top left pixel
+  int originY;
+  int width;
+  int height;
+
+  Eigen::ArrayXd depth;     // distance along the primary ray, infinity on a miss
+  Eigen::ArrayXi objectId;  // index in World::sceneObjects, -1 on a miss
+  Eigen::ArrayX3d position;
+  Eigen::ArrayX3d normal;
+  Eigen::ArrayX3d albedo;
+  Eigen::ArrayX3d direction; // of the primary ray, also set on a miss
+
+  GBuffer(int pOriginX, int pOriginY, int pWidth, int pHeight)
+  {
+    originX = pOriginX;
+    originY = pOriginY;
+    width = pWidth;
+    height = pHeight;
+
+    int pixels = width * height;
+    depth.resize(pixels);
+    objectId.resize(pixels);
+    position.resize(pixels, 3);
+    normal.resize(pixels, 3);
+    albedo.resize(pixels, 3);
+    direction.resize(pixels, 3);
+  }
+
+  int index(int x, int y) const
+  {
+    return y * width + x;
+  }
+
+  bool hasHits() const
+  {
+    return (objectId >= 0).any();
+  }
+
+  // The pixels whose screen coordinates are both multiples of step, as the G-buffer of an image
+  // step times smaller: its origin is in that image's pixels.
+  GBuffer subsample(int step) const
+  {
+    int firstX = (step - originX % step) % step;
+    int firstY = (step - originY % step) % step;
+    GBuffer coarse((originX + firstX) / step, (originY + firstY) / step, (width - firstX + step - 1) / step, (height - firstY + step - 1) / step);
+
+    for (int y = 0; y < coarse.height; ++y)
+    {
+      for (int x = 0; x < coarse.width; ++x)
+      {
+        int i = coarse.index(x, y);
+        int source = index(firstX + x * step, firstY + y * step);
+        coarse.depth(i) = depth(source);
+        coarse.objectId(i) = objectId(source);
+        coarse.position.row(i) = position.row(source);
+        coarse.normal.row(i) = normal.row(source);
+        coarse.albedo.row(i) = albedo.row(source);
+        coarse.direction.row(i) = direction.row(source);
+      }
+    }
+    return coarse;
+  }
+
+  void write(int i, const Ray& ray, const RayHitResult& hitResult)
+  {
+    direction.row(i) = ray.direction.transpose();
+
+    if (hitResult.hit)
+    {
+      depth(i) = hitResult.distance;
+      objectId(i) = hitResult.objectId;
+      position.row(i) = hitResult.hitPosition.transpose();
+      normal.row(i) = hitResult.hitObject->normalAt(hitResult.hitPosition).transpose();
+      albedo.row(i) = hitResult.hitObject->color.transpose();
+    }
+    else
+    {
+      depth(i) = std::numeric_limits<double>::infinity();
+      objectId(i) = -1;
+      position.row(i).setZero();
+      normal.row(i).setZero();
+      albedo.row(i).setZero();
+    }
+  }
+};
+
+// Running per-pixel statistics of the samples taken so far in one tile: the colour sum for the
+// mean, and Welford's running mean and sum of squared deviations of luminance for the variance.
+struct TileAccumulator
+{
+  int samples = 0;
+  Eigen::ArrayX3d colorSum;
+  Eigen::ArrayXd luminanceMean;
+  Eigen::ArrayXd luminanceM2;
+
+  void reset(int pixels)
+  {
+    samples = 0;
+    colorSum.setZero(pixels, 3);
+    luminanceMean.setZero(pixels);
+    luminanceM2.setZero(pixels);
+  }
+
+  void add(const Eigen::ArrayX3d& color)
+  {
+    samples++;
+    colorSum += color;
+
+    Eigen::ArrayXd luminance = 0.2126 * color.col(0) + 0.7152 * color.col(1) + 0.0722 * color.col(2);
+    Eigen::ArrayXd delta = luminance - luminanceMean;
+    luminanceMean += delta / samples;
+    luminanceM2 += delta * (luminance - luminanceMean);
+  }
+
+  // Root mean square over the tile of every pixel's standard error relative to its brightness.
+  // The +1 (on the 0-255 scale) keeps near-black pixels from dominating.
+  double error() const
+  {
+    if (samples < 2)
+    {
+      return std::numeric_limits<double>::infinity();
+    }
+
+    Eigen::ArrayXd standardError = (luminanceM2 / (samples - 1) / samples).sqrt();
+    return sqrt((standardError / (luminanceMean + 1)).square().mean());
+  }
+
+  Eigen::ArrayX3d mean() const
+  {
+    return colorSum / samples;
+  }
+};
+
+// Sampler dimensions of a pixel sample used by the camera to place the primary ray in the
+// pixel. Integrators start at this dimension.
+const int CameraDimensions = 2;
+
+// Turns the primary hits in a G-buffer into pixel colours. The trace pass is shared, so an
+// integrator only decides how light reaches those hits.
+class Integrator
+{
+  public:
+  World* world;
+  RenderSettings settings;
+
+  Integrator(World* pWorld, const RenderSettings& pSettings)
+  {
+    world = pWorld;
+    settings = pSettings;
+  }
+
+  virtual ~Integrator() {}
+
+  // Called once before the tiles of a frame are shaded, possibly from several threads.
+  void beginFrame()
+  {
+    buildLightSamplers();
+  }
+
+  // Shades one sample of every pixel in the G-buffer. Different sample indices give different
+  // random numbers, the same index always gives the same result.
+  virtual void shade(const GBuffer& gbuffer, int sampleIndex, Eigen::ArrayX3d& color) = 0;
+
+  protected:
+
+  LightBVH lightTree;
+  AliasTable lightPowerTable;
+
+  Sampler createSampler() const
+  {
+    return Sampler(settings.sampler, settings.samplesPerPixel, std::max(settings.width, settings.height));
+  }
+
+  void buildLightSamplers()
+  {
+    if (settings.lightSampler == LightSampler::Tree)
+    {
+      lightTree.build(world->lights);
+    }
+    else
+    {
+      std::vector<double> powers(world->lights.size());
+      for (int i = 0; i < int(powers.size()); ++i)
+      {
+        powers[i] = world->lights[i].power();
+      }
+      lightPowerTable.build(powers);
+    }
+  }
+
+  // Picks a light for a shading point with settings.lightSampler. Returns -1 without lights.
+  int pickLight(const Eigen::Vector3d& position, const Eigen::Vector3d& normal, double u, double& pdf) const
+  {
+    if (settings.lightSampler == LightSampler::Tree)
+    {
+      return lightTree.sample(position, normal, u, pdf);
+    }
+
+    pdf = 0;
+    return lightPowerTable.empty() ? -1 : lightPowerTable.sample(u, pdf);
+  }
+
+  // What a ray that hits nothing sees.
+  Eigen::Vector3d backgroundColor(const Eigen::Vector3d& direction) const
+  {
+    if (world->environment)
+    {
+      return 255 * world->environment->lookup(direction);
+    }
+
+    return Eigen::Vector3d::Constant(50);
+  }
+};
+
+// Single-bounce shading: the Lambert term of every light (or a sample of them) and of the
+// environment, with shadow rays, evaluated for the whole G-buffer at once.
+class DirectLighting : public Integrator
+{
+  // Sampler dimensions of one light or environment sample: one to pick, two for the point or
+  // direction, and a spare so that Sampler::get2D can keep those two in one block of dimensions.
+  static const int DimensionsPerSample = 4;
+
+  public:
+
+  DirectLighting(World* pWorld, const RenderSettings& pSettings)
+    : Integrator(pWorld, pSettings)
+  {
+  }
+
+  // Shades the whole G-buffer at once. Every operation below runs over all pixels of a
+  // channel, which lets Eigen use SIMD instructions across pixels.
+  virtual void shade(const GBuffer& gbuffer, int sampleIndex, Eigen::ArrayX3d& color)
+  {
+    int pixels = gbuffer.depth.size();
+    color.setZero();
+
+    Sampler sampler = createSampler();
+
+    // With few lights every light is evaluated, otherwise each pixel samples
+    // settings.lightSamples lights from the light tree.
+    bool sampleLights = int(world->lights.size()) > settings.lightSamples;
+    int lightSamples = sampleLights ? settings.lightSamples : world->lights.size();
+
+    Eigen::ArrayX3d lightPos(pixels, 3);
+    Eigen::ArrayX3d lightRadiance(pixels, 3);
+
+    for (int s = 0; s < lightSamples; ++s)
+    {
+      if (sampleLights)
+      {
+        pickLights(gbuffer, sampler, sampleIndex, s, lightPos, lightRadiance);
+      }
+      else
+      {
+        const Light& light = world->lights[s];
+        lightPos.rowwise() = light.pos.transpose().array();
+        lightRadiance.rowwise() = (light.intensity * light.color / 255).transpose().array();
+      }
+
+      Eigen::ArrayXd toLightX = lightPos.col(0) - gbuffer.position.col(0);
+      Eigen::ArrayXd toLightY = lightPos.col(1) - gbuffer.position.col(1);
+      Eigen::ArrayXd toLightZ = lightPos.col(2) - gbuffer.position.col(2);
+
+      Eigen::ArrayXd distanceFromLight = (toLightX.square() + toLightY.square() + toLightZ.square()).sqrt();
+
+      Eigen::ArrayXd lightAngle =
+        ( toLightX * gbuffer.normal.col(0) +
+          toLightY * gbuffer.normal.col(1) +
+          toLightZ * gbuffer.normal.col(2) ) / distanceFromLight;
+
+      Eigen::ArrayXd lightVisibility = traceShadowRays(gbuffer, lightAngle, lightPos);
+
+      // pixels facing away from the light get nothing from it
+      Eigen::ArrayXd lighting = (lightAngle > 0).select(lightAngle * lightAttenuation<Eigen::ArrayXd>(distanceFromLight) * lightVisibility, 0.0);
+
+      for (int c = 0; c < 3; ++c)
+      {
+        color.col(c) += gbuffer.albedo.col(c) * lighting * lightRadiance.col(c);
+      }
+    }
+
+    if (world->environment)
+    {
+      shadeEnvironment(gbuffer, sampler, sampleIndex, color);
+    }
+
+    Eigen::ArrayX3d background(pixels, 3);
+    for (int i = 0; i < pixels; ++i)
+    {
+      if (gbuffer.objectId(i) < 0)
+      {
+        Eigen::Vector3d direction = gbuffer.direction.row(i).transpose();
+        background.row(i) = backgroundColor(direction).transpose();
+      }
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+      color.col(c) = (gbuffer.objectId >= 0).select(color.col(c), background.col(c));
+    }
+  }
+
+  // Adds light from the environment map: one direction per pixel and sample, picked from the
+  // environment's alias table, then the same cosine weighting as the lights. Its sampler
+  // dimensions come after those of the light samples.
+  void shadeEnvironment(const GBuffer& gbuffer, Sampler& sampler, int sampleIndex, Eigen::ArrayX3d& color)
+  {
+    const EnvironmentMap& environment = *world->environment;
+
+    int pixels = gbuffer.depth.size();
+    Eigen::ArrayX3d incoming(pixels, 3);
+    Eigen::ArrayXd cosine(pixels);
+    Eigen::ArrayXd u1(pixels), u2(pixels), u3(pixels);
+
+    for (int s = 0; s < settings.lightSamples; ++s)
+    {
+      int dimension = CameraDimensions + DimensionsPerSample * (settings.lightSamples + s);
+      sampleTile(gbuffer, sampler, sampleIndex, dimension, u1, u2, u3);
+
+      for (int i = 0; i < pixels; ++i)
+      {
+        incoming.row(i).setZero();
+        cosine(i) = 0;
+
+        if (gbuffer.objectId(i) < 0)
+        {
+          continue;
+        }
+
+        double pdf;
+        Eigen::Vector3d direction = environment.sample(u1(i), u2(i), u3(i), pdf);
+        Eigen::Vector3d normal = gbuffer.normal.row(i).transpose().matrix().normalized();
+        Eigen::Vector3d position = gbuffer.position.row(i).transpose();
+
+        cosine(i) = direction.dot(normal);
+        if (pdf > 0 && cosine(i) > 0 && !world->isOccluded(position, position + direction * 1e6))
+        {
+          incoming.row(i) = environment.lookup(direction).transpose() / (pdf * settings.lightSamples);
+        }
+      }
+
+      // Lambert: albedo / pi * incoming radiance * cosine
+      Eigen::ArrayXd weight = (cosine > 0).select(cosine / M_PI, 0.0);
+      for (int c = 0; c < 3; ++c)
+      {
+        color.col(c) += gbuffer.albedo.col(c) * incoming.col(c) * weight;
+      }
+    }
+  }
+
+  // Picks one light per pixel and writes a point on it, and its radiance
+  // divided by the probability of picking it, for the shading pass to evaluate.
+  void pickLights(const GBuffer& gbuffer, Sampler& sampler, int sampleIndex, int lightSample, Eigen::ArrayX3d& lightPos, Eigen::ArrayX3d& lightRadiance)
+  {
+    int pixels = gbuffer.depth.size();
+    Eigen::ArrayXd u1(pixels), u2(pixels), u3(pixels);
+    sampleTile(gbuffer, sampler, sampleIndex, CameraDimensions + DimensionsPerSample * lightSample, u1, u2, u3);
+
+    for (int i = 0; i < pixels; ++i)
+    {
+      double pdf = 0;
+      int lightIndex = -1;
+
+      if (gbuffer.objectId(i) >= 0)
+      {
+        Eigen::Vector3d position = gbuffer.position.row(i).transpose();
+        Eigen::Vector3d normal = gbuffer.normal.row(i).transpose();
+        lightIndex = pickLight(position, normal, u1(i), pdf);
+      }
+
+      if (lightIndex < 0)
+      {
+        lightPos.row(i).setZero();
+        lightRadiance.row(i).setZero();
+        continue;
+      }
+
+      const Light& light = world->lights[lightIndex];
+      lightPos.row(i) = light.samplePosition(u2(i), u3(i)).transpose();
+      lightRadiance.row(i) = (light.intensity * light.color / (255 * pdf * settings.lightSamples)).transpose();
+    }
+  }
+
+  // The random numbers of one light or environment sample for every pixel of the G-buffer,
+  // drawn a row at a time: u1 from get1D, then u2 and u3 from get2D.
+  void sampleTile(const GBuffer& gbuffer, Sampler& sampler, int sampleIndex, int dimension, Eigen::ArrayXd& u1, Eigen::ArrayXd& u2, Eigen::ArrayXd& u3)
+  {
+    for (int y = 0; y < gbuffer.height; ++y)
+    {
+      int row = gbuffer.index(0, y);
+      sampler.get1DRow(gbuffer.originX, gbuffer.originY + y, sampleIndex, dimension, gbuffer.width, u1.data() + row);
+      sampler.get2DRow(gbuffer.originX, gbuffer.originY + y, sampleIndex, dimension + 1, gbuffer.width, u2.data() + row, u3.data() + row);
+    }
+  }
+
+  // 1 where the light can be seen from the hit point, 0 where another object blocks it.
+  // Pixels facing away from the light get nothing from it, so they skip the shadow ray.
+  Eigen::ArrayXd traceShadowRays(const GBuffer& gbuffer, const Eigen::ArrayXd& lightAngle, const Eigen::ArrayX3d& lightPos)
+  {
+    Eigen::ArrayXd visibility = Eigen::ArrayXd::Ones(gbuffer.depth.size());
+
+    for (int i = 0; i < visibility.size(); ++i)
+    {
+      if (gbuffer.objectId(i) >= 0 && lightAngle(i) > 0)
+      {
+        Eigen::Vector3d hitPosition = gbuffer.position.row(i).transpose();
+        Eigen::Vector3d samplePosition = lightPos.row(i).transpose();
+        visibility(i) = world->isOccluded(hitPosition, samplePosition) ? 0 : 1;
+      }
+    }
+
+    return visibility;
+  }
+};
+
+// Cosine-weighted direction around the normal, for a pair of random numbers in [0, 1).
+// Its pdf is cos(theta) / pi, which cancels the Lambert BRDF's cosine and 1 / pi.
+Eigen::Vector3d sampleCosineHemisphere(const Eigen::Vector3d& normal, double u1, double u2)
+{
+  Eigen::Vector3d tangent = (std::abs(normal.x()) > 0.9 ? Eigen::Vector3d::UnitY() : Eigen::Vector3d::UnitX()).cross(normal).normalized();
+  Eigen::Vector3d bitangent = normal.cross(tangent);
+
+  double r = sqrt(u1);
+  double phi = 2 * M_PI * u2;
+  return r * cos(phi) * tangent + r * sin(phi) * bitangent + sqrt(std::max(0.0, 1 - u1)) * normal;
+}
+
+// Unidirectional path tracer. At every vertex one light is sampled directly (next-event
+// estimation), then the path continues in a cosine-weighted direction off the Lambert surface.
+// After settings.russianRouletteDepth vertices a path survives with a probability that follows
+// its throughput, so dim paths stop early while bright ones go on, up to settings.maxDepth.
+class PathTracer : public Integrator
+{
+  public:
+
+  PathTracer(World* pWorld, const RenderSettings& pSettings)
+    : Integrator(pWorld, pSettings)
+  {
+  }
+
+  virtual void shade(const GBuffer& gbuffer, int sampleIndex, Eigen::ArrayX3d& color)
+  {
+    Sampler sampler = createSampler();
+
+    for (int y = 0; y < gbuffer.height; ++y)
+    {
+      for (int x = 0; x < gbuffer.width; ++x)
+      {
+        int i = gbuffer.index(x, y);
+
+        if (gbuffer.objectId(i) < 0)
+        {
+          Eigen::Vector3d direction = gbuffer.direction.row(i).transpose();
+          color.row(i) = backgroundColor(direction).transpose();
+          continue;
+        }
+
+        sampler.startPixelSample(gbuffer.originX + x, gbuffer.originY + y, sampleIndex, CameraDimensions);
+        color.row(i) = tracePath(gbuffer, i, sampler).transpose();
+      }
+    }
+  }
+
+  private:
+
+  // Follows one path starting at the primary hit of pixel i. Colours are in the same 0-255
+  // scale as the objects' colours.
+  Eigen::Vector3d tracePath(const GBuffer& gbuffer, int i, Sampler& sampler) const
+  {
+    Eigen::Vector3d position = gbuffer.position.row(i).transpose();
+    Eigen::Vector3d normal = gbuffer.normal.row(i).transpose().matrix().normalized();
+    Eigen::Vector3d albedo = gbuffer.albedo.row(i).transpose();
+
+    Eigen::Vector3d radiance = Eigen::Vector3d::Zero();
+    Eigen::Vector3d throughput = Eigen::Vector3d::Ones();
+
+    for (int depth = 0; ; ++depth)
+    {
+      radiance += throughput.cwiseProduct(sampleLight(position, normal, albedo, sampler));
+
+      if (depth + 1 >= settings.maxDepth)
+      {
+        break;
+      }
+
+      Eigen::Vector2d u = sampler.get2D();
+      Eigen::Vector3d direction = sampleCosineHemisphere(normal, u.x(), u.y());
+      throughput = throughput.cwiseProduct(albedo / 255);
+
+      if (depth + 1 >= settings.russianRouletteDepth)
+      {
+        double survival = std::min(1.0, throughput.maxCoeff());
+        if (sampler.get1D() >= survival)
+        {
+          break;
+        }
+        throughput /= survival;
+      }
+
+      Ray ray;
+      ray.origin = position + normal * 1e-6;
+      ray.direction = direction;
+      RayHitResult hitResult = world->findClosestHit(ray);
+
+      if (!hitResult.hit)
+      {
+        if (world->environment)
+        {
+          // the environment was also sampled directly, weight both strategies (power heuristic)
+          double bsdfPdf = direction.dot(normal) / M_PI;
+          double lightPdf = world->environment->pdf(direction);
+          double weight = bsdfPdf * bsdfPdf / (bsdfPdf * bsdfPdf + lightPdf * lightPdf);
+          radiance += weight * 255 * throughput.cwiseProduct(world->environment->lookup(direction));
+        }
+        break;
+      }
+
+      position = hitResult.hitPosition;
+      normal = hitResult.hitObject->normalAt(position).normalized();
+      albedo = hitResult.hitObject->color;
+      if (normal.dot(direction) > 0)
+      {
+        normal = -normal;
+      }
+    }
+
+    return radiance;
+  }
+
+  // Next-event estimation: light reaching the surface straight from one picked light, plus
+  // one environment direction when there is an environment map.
+  Eigen::Vector3d sampleLight(const Eigen::Vector3d& position, const Eigen::Vector3d& normal, const Eigen::Vector3d& albedo, Sampler& sampler) const
+  {
+    Eigen::Vector3d radiance = Eigen::Vector3d::Zero();
+
+    double pdf;
+    int lightIndex = pickLight(position, normal, sampler.get1D(), pdf);
+    Eigen::Vector2d u = sampler.get2D();
+
+    if (lightIndex >= 0 && pdf > 0)
+    {
+      const Light& light = world->lights[lightIndex];
+      Eigen::Vector3d lightPos = light.samplePosition(u.x(), u.y());
+      Eigen::Vector3d toLight = lightPos - position;
+      double distance = toLight.norm();
+      double cosine = toLight.dot(normal) / distance;
+
+      if (cosine > 0 && !world->isOccluded(position, lightPos))
+      {
+        radiance += albedo.cwiseProduct(light.intensity * light.color / 255) * cosine * lightAttenuation(distance) / pdf;
+      }
+    }
+
+    if (world->environment)
+    {
+      double u3 = sampler.get1D();
+      Eigen::Vector2d u45 = sampler.get2D();
+      double lightPdf;
+      Eigen::Vector3d direction = world->environment->sample(u3, u45.x(), u45.y(), lightPdf);
+      double cosine = direction.dot(normal);
+
+      if (lightPdf > 0 && cosine > 0 && !world->isOccluded(position, position + direction * 1e6))
+      {
+        double bsdfPdf = cosine / M_PI;
+        double weight = lightPdf * lightPdf / (lightPdf * lightPdf + bsdfPdf * bsdfPdf);
+        radiance += weight * albedo.cwiseProduct(world->environment->lookup(direction)) * cosine / (M_PI * lightPdf);
+      }
+    }
+
+    return radiance;
+  }
+};
+
+// Linear HDR colour of every pixel, row by row, as float RGBA: a pixel is one 16 byte
+// vector, and 1 is the brightest value a display can show before tone mapping.
+typedef Eigen::Array<float, Eigen::Dynamic, 4, Eigen::RowMajor> Framebuffer;
+typedef Eigen::Array<Eigen::half, Eigen::Dynamic, 4, Eigen::RowMajor> HalfFramebuffer;
+
+// Converts count floats to half floats (round to nearest) and back, 8 values per instruction
+// with F16C, one at a time through Eigen::half without it.
+void floatToHalf(const float* in, Eigen::half* out, int count)
+{
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i packed = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(out + i), packed);
+  }
+#endif
+  for (; i < count; ++i)
+  {
+    out[i] = Eigen::half(in[i]);
+  }
+}
+
+void halfToFloat(const Eigen::half* in, float* out, int count)
+{
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= count; i += 8)
+  {
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+  }
+#endif
+  for (; i < count; ++i)
+  {
+    out[i] = float(in[i]);
+  }
+}
+
+// Full screen RGBA storage, as float or as half float. Pixels are written and read as float
+// Framebuffer rows, so everything in flight stays float and only the stored copy is rounded.
+//
+// The pixels are stored in blocks of FrameTileSize x FrameTileSize, one block after the other,
+// so that the rows a render tile writes are close together in memory, instead of a full image
+// width apart. Even very wide images then keep each worker's writes within a few cache lines and
+// pages. Reading a row puts it back in screen order.
+const int FrameTileSize = 64;
+
+class FrameStore
+{
+  bool half;
+  Framebuffer full;
+  HalfFramebuffer compact;
+  int tilesX;
+
+  public:
+
+  int width;
+  int height;
+
+  FrameStore(bool pHalf, int pWidth, int pHeight)
+  {
+    half = pHalf;
+    width = pWidth;
+    height = pHeight;
+
+    tilesX = (width + FrameTileSize - 1) / FrameTileSize;
+    int tilesY = (height + FrameTileSize - 1) / FrameTileSize;
+    int storedPixels = tilesX * tilesY * FrameTileSize * FrameTileSize;
+
+    if (half)
+    {
+      compact.setZero(storedPixels, 4);
+    }
+    else
+    {
+      full.setZero(storedPixels, 4);
+    }
+  }
+
+  // Stores the colour of a tile, in the 0-255 scale of the integrators.
+  void writeTile(const GBuffer& gbuffer, const Eigen::ArrayX3d& color)
+  {
+    Framebuffer row(gbuffer.width, 4);
+    row.col(3).setOnes();
+    for (int y = 0; y < gbuffer.height; ++y)
+    {
+      row.leftCols(3) = (color.middleRows(gbuffer.index(0, y), gbuffer.width) / 255).cast<float>();
+      write(gbuffer.originX, gbuffer.originY + y, row);
+    }
+  }
+
+  // Stores the pixels of row, which go from (x, y) to the right.
+  void write(int x, int y, const Framebuffer& row)
+  {
+    for (int done = 0; done < row.rows(); )
+    {
+      int count = std::min<int>(row.rows() - done, FrameTileSize - (x + done) % FrameTileSize);
+      int first = offset(x + done, y);
+
+      if (half)
+      {
+        floatToHalf(row.data() + 4 * done, compact.data() + 4 * first, 4 * count);
+      }
+      else
+      {
+        full.middleRows(first, count) = row.middleRows(done, count);
+      }
+      done += count;
+    }
+  }
+
+  size_t bytes() const
+  {
+    return half ? compact.size() * sizeof(Eigen::half) : full.size() * sizeof(float);
+  }
+
+  // Reads count pixels from (x, y) to the right.
+  void read(int x, int y, int count, Framebuffer& row) const
+  {
+    row.resize(count, 4);
+
+    for (int done = 0; done < count; )
+    {
+      int length = std::min(count - done, FrameTileSize - (x + done) % FrameTileSize);
+      int first = offset(x + done, y);
+
+      if (half)
+      {
+        halfToFloat(compact.data() + 4 * first, row.data() + 4 * done, 4 * length);
+      }
+      else
+      {
+        row.middleRows(done, length) = full.middleRows(first, length);
+      }
+      done += length;
+    }
+  }
+
+  private:
+
+  int offset(int x, int y) const
+  {
+    int tile = (y / FrameTileSize) * tilesX + x / FrameTileSize;
+    return tile * FrameTileSize * FrameTileSize + (y % FrameTileSize) * FrameTileSize + x % FrameTileSize;
+  }
+};
+
+// One channel of a full screen image, row by row, so that a row is contiguous.
+typedef Eigen::Array<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Plane;
+
+// What the denoiser knows about the surface seen by every pixel. Misses have MissDepth, a
+// zero normal and a white albedo. variance is that of the pixel's mean luminance, estimated
+// from its samples, or negative where there are too few samples to tell.
+struct DenoiserGuides
+{
+  constexpr static float MissDepth = 1e6f;
+
+  Plane depth;
+  Plane normal[3];
+  Plane albedo[3];
+  Plane variance;
+
+  DenoiserGuides(int width, int height)
+  {
+    depth.setZero(height, width);
+    variance.setConstant(height, width, -1);
+    for (int c = 0; c < 3; ++c)
+    {
+      normal[c].setZero(height, width);
+      albedo[c].setOnes(height, width);
+    }
+  }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each pass blurs with a 5x5
+// B3 spline kernel whose taps are step pixels apart, the step doubling from pass to pass, so a
+// few passes cover a wide area at 25 taps per pixel each. Every tap is weighted down by how much
+// its normal and depth differ from the centre pixel's, which keeps silhouettes sharp, and by
+// how much its luminance differs compared to the centre pixel's noise, which keeps shadow
+// boundaries and shading. As in SVGF (Schied et al. 2017) the noise is the per-pixel variance
+// of the samples, filtered along with the colour, or estimated from the 3x3 neighbourhood with
+// a single sample. The colour is divided by the albedo before filtering and multiplied back
+// after, so object colours aren't blurred either. Background pixels are left as they are.
+//
+// Passes run over rows in parallel, and each tap is applied to a whole row at once with Eigen.
+class Denoiser
+{
+  // Scales of the edge stopping functions.
+  constexpr static float LuminanceSigma = 4;  // in standard deviations of the noise
+  constexpr static float NormalSigma = 0.125f;
+  constexpr static float DepthSigma = 0.05f;  // relative to the centre pixel's depth
+
+  int iterations;
+
+  public:
+
+  Denoiser(int pIterations)
+  {
+    iterations = pIterations;
+  }
+
+  // Filters the RGB of every pixel of frame in place, alpha is kept. A pass only starts if, at
+  // the pace of the earlier ones, it will be done by deadline. Returns the passes done.
+  int denoise(FrameStore& frame, const DenoiserGuides& guides, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) const
+  {
+    int width = frame.width;
+    int height = frame.height;
+
+    Plane color[3], filtered[3];
+    for (int c = 0; c < 3; ++c)
+    {
+      color[c].resize(height, width);
+      filtered[c].resize(height, width);
+    }
+    Plane luminance(height, width);
+    Plane variance(height, width);
+    Plane filteredVariance(height, width);
+    Plane deviation(height, width);
+
+    parallelFor(0, height, [&](int y)
+    {
+      Framebuffer row;
+      frame.read(0, y, width, row);
+      for (int c = 0; c < 3; ++c)
+      {
+        color[c].row(y) = row.col(c).transpose() / guides.albedo[c].row(y).max(1e-3f);
+      }
+      luminance.row(y) = toLuminance(color, y);
+    });
+
+    parallelFor(0, height, [&](int y)
+    {
+      Row albedoLuminance = (0.2126f * guides.albedo[0].row(y) + 0.7152f * guides.albedo[1].row(y) + 0.0722f * guides.albedo[2].row(y)).max(1e-3f);
+      Row spatialVariance = (boxMean(luminance.square(), y) - boxMean(luminance, y).square()).max(0.0f);
+      variance.row(y) = (guides.variance.row(y) >= 0).select(guides.variance.row(y) / albedoLuminance.square(), spatialVariance);
+    });
+
+    int pass = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (; pass < iterations; ++pass)
+    {
+      auto now = std::chrono::steady_clock::now();
+      if (pass > 0 && deadline - now < (now - start) / pass)
+      {
+        break;
+      }
+
+      parallelFor(0, height, [&](int y)
+      {
+        deviation.row(y) = boxMean(variance, y).sqrt();
+      });
+      parallelFor(0, height, [&](int y)
+      {
+        filterRow(color, luminance, variance, deviation, filtered, filteredVariance, guides, y, 1 << pass);
+      });
+      parallelFor(0, height, [&](int y)
+      {
+        luminance.row(y) = toLuminance(filtered, y);
+      });
+
+      for (int c = 0; c < 3; ++c)
+      {
+        color[c].swap(filtered[c]);
+      }
+      variance.swap(filteredVariance);
+    }
+
+    parallelFor(0, height, [&](int y)
+    {
+      Framebuffer row;
+      frame.read(0, y, width, row);
+      Eigen::Array<bool, 1, Eigen::Dynamic> surface = guides.depth.row(y) < DenoiserGuides::MissDepth;
+      for (int c = 0; c < 3; ++c)
+      {
+        row.col(c) = surface.select(color[c].row(y) * guides.albedo[c].row(y).max(1e-3f), row.col(c).transpose()).transpose();
+      }
+      frame.write(0, y, row);
+    });
+    return pass;
+  }
+
+  private:
+
+  typedef Eigen::Array<float, 1, Eigen::Dynamic> Row;
+
+  static Row toLuminance(const Plane (&color)[3], int y)
+  {
+    return 0.2126f * color[0].row(y) + 0.7152f * color[1].row(y) + 0.0722f * color[2].row(y);
+  }
+
+  // Mean of the 3x3 pixels around each pixel of row y.
+  template <typename PlaneExpression>
+  static Row boxMean(const PlaneExpression& plane, int y)
+  {
+    int height = plane.rows();
+    int width = plane.cols();
+
+    Row sum = Row::Zero(width);
+    Row count = Row::Zero(width);
+
+    for (int tapY = std::max(0, y - 1); tapY <= std::min(height - 1, y + 1); ++tapY)
+    {
+      for (int offset = -1; offset <= 1; ++offset)
+      {
+        int first = std::max(0, -offset);
+        int length = std::min(width, width - offset) - first;
+        sum.segment(first, length) += plane.row(tapY).segment(first + offset, length);
+        count.segment(first, length) += 1;
+      }
+    }
+
+    return sum / count;
+  }
+
+  void filterRow(
+    const Plane (&color)[3], const Plane& luminance, const Plane& variance, const Plane& deviation,
+    Plane (&filtered)[3], Plane& filteredVariance, const DenoiserGuides& guides, int y, int step) const
+  {
+    static const float kernel[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f, 1 / 16.0f};
+
+    int height = color[0].rows();
+    int width = color[0].cols();
+
+    Row weightSum = Row::Zero(width);
+    Row varianceSum = Row::Zero(width);
+    Row sum[3] = {Row::Zero(width), Row::Zero(width), Row::Zero(width)};
+
+    for (int dy = -2; dy <= 2; ++dy)
+    {
+      int tapY = y + dy * step;
+      if (tapY < 0 || tapY >= height)
+      {
+        continue;
+      }
+
+      for (int dx = -2; dx <= 2; ++dx)
+      {
+        // the centre pixels [first, first + count) have their tap inside the image
+        int offset = dx * step;
+        int first = std::max(0, -offset);
+        int count = std::min(width, width - offset) - first;
+        if (count <= 0)
+        {
+          continue;
+        }
+
+        Row normalDistance = Row::Zero(count);
+        for (int c = 0; c < 3; ++c)
+        {
+          normalDistance += (guides.normal[c].row(y).segment(first, count) - guides.normal[c].row(tapY).segment(first + offset, count)).square();
+        }
+
+        Row luminanceDistance =
+          (luminance.row(y).segment(first, count) - luminance.row(tapY).segment(first + offset, count)).abs() /
+          (LuminanceSigma * deviation.row(y).segment(first, count) + 1e-4f);
+
+        Row depth = guides.depth.row(y).segment(first, count);
+        Row depthDistance = (depth - guides.depth.row(tapY).segment(first + offset, count)).abs() / (DepthSigma * depth);
+
+        Row weight = kernel[dx + 2] * kernel[dy + 2] * (
+          -luminanceDistance
+          - normalDistance / (NormalSigma * NormalSigma)
+          - depthDistance).exp();
+
+        weightSum.segment(first, count) += weight;
+        varianceSum.segment(first, count) += weight.square() * variance.row(tapY).segment(first + offset, count);
+        for (int c = 0; c < 3; ++c)
+        {
+          sum[c].segment(first, count) += weight * color[c].row(tapY).segment(first + offset, count);
+        }
+      }
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+      filtered[c].row(y) = sum[c] / weightSum;
+    }
+    filteredVariance.row(y) = varianceSum / weightSum.square();
+  }
+};
+
+// Buffers of the AOVs in RenderSettings::aovs, filled from the G-buffers of the trace pass.
+// AOVs that aren't asked for have no buffer and cost nothing. Each is stored as RGB (a scalar
+// AOV repeated in all three) plus coverage in alpha: 1 on a hit, 0 on a miss.
+class AovBuffers
+{
+  public:
+  std::vector<Aov> aovs;
+  std::vector<FrameStore> buffers; // one per entry of aovs
+
+  AovBuffers(const RenderSettings& pSettings)
+  {
+    aovs = pSettings.aovs;
+    for (int i = 0; i < int(aovs.size()); ++i)
+    {
+      buffers.emplace_back(pSettings.halfFloat, pSettings.width, pSettings.height);
+    }
+  }
+
+  // Copies the AOVs of one tile's primary hits, a row at a time.
+  void write(const GBuffer& gbuffer)
+  {
+    for (int a = 0; a < int(aovs.size()); ++a)
+    {
+      Framebuffer row(gbuffer.width, 4);
+
+      for (int y = 0; y < gbuffer.height; ++y)
+      {
+        int first = gbuffer.index(0, y);
+        auto hit = (gbuffer.objectId.segment(first, gbuffer.width) >= 0).cast<float>();
+        row.col(3) = hit;
+
+        if (aovs[a] == Aov::Depth)
+        {
+          row.leftCols(3).colwise() = gbuffer.depth.segment(first, gbuffer.width).cast<float>();
+        }
+        else if (aovs[a] == Aov::Normal)
+        {
+          auto normal = gbuffer.normal.middleRows(first, gbuffer.width);
+          Eigen::ArrayXd length = normal.square().rowwise().sum().sqrt().max(1e-12);
+          row.leftCols(3) = (normal.colwise() / length).cast<float>();
+        }
+        else if (aovs[a] == Aov::ObjectId)
+        {
+          row.leftCols(3).colwise() = gbuffer.objectId.segment(first, gbuffer.width).cast<float>();
+        }
+        else
+        {
+          row.leftCols(3) = (gbuffer.albedo.middleRows(first, gbuffer.width) / 255).cast<float>();
+        }
+
+        buffers[a].write(gbuffer.originX, gbuffer.originY + y, row);
+      }
+    }
+  }
+
+  // Writes every buffer to prefix_<name>.pfm. Returns false if a file couldn't be written.
+  bool save(const std::string& prefix) const
+  {
+    for (int a = 0; a < int(aovs.size()); ++a)
+    {
+      if (!savePfm(prefix + "_" + aovNames[int(aovs[a])] + ".pfm", buffers[a]))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  private:
+
+  // Colour PFM, the format EnvironmentMap::load reads: bottom row first, native floats with a
+  // scale whose sign gives their byte order.
+  static bool savePfm(const std::string& path, const FrameStore& buffer)
+  {
+    int width = buffer.width;
+    int height = buffer.height;
+    unsigned short byteOrderProbe = 1;
+    bool littleEndian = *reinterpret_cast<unsigned char*>(&byteOrderProbe) == 1;
+
+    std::ofstream file(path, std::ios::binary);
+    file << "PF\n" << width << " " << height << "\n" << (littleEndian ? "-1.0" : "1.0") << "\n";
+
+    std::vector<float> rgb(width * 3);
+    Framebuffer row;
+    for (int y = height - 1; y >= 0; --y)
+    {
+      buffer.read(0, y, width, row);
+      for (int x = 0; x < width; ++x)
+      {
+        for (int c = 0; c < 3; ++c)
+        {
+          rgb[x * 3 + c] = row(x, c);
+        }
+      }
+      file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size() * sizeof(float));
+    }
+
+    return bool(file);
+  }
+};
+
+// Writes an uncompressed, tiled OpenEXR file (RGBA, float or half, one resolution level) one tile
+// at a time and in any order, so an image can go to disk as its tiles finish without ever being
+// in memory whole. The table of tile offsets is the only thing kept; it is filled in at close().
+class TiledExrWriter
+{
+  std::ofstream file;
+  std::mutex mutex;
+
+  int width = 0;
+  int height = 0;
+  int tileSize = 0;
+  int tilesX = 0;
+  bool half = false;
+
+  std::streamoff offsetTablePosition = 0;
+  std::vector<unsigned long long> tileOffsets; // by tile row, then tile column
+
+  public:
+
+  bool open(const std::string& path, int pWidth, int pHeight, int pTileSize, bool pHalf)
+  {
+    width = pWidth;
+    height = pHeight;
+    tileSize = pTileSize;
+    half = pHalf;
+    tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    file.open(path, std::ios::binary);
+    if (!file)
+    {
+      return false;
+    }
+
+    writeInt(20000630);  // magic number
+    writeInt(2 | 0x200); // version 2, single part tiled
+
+    // channels, sorted by name
+    std::string channels;
+    for (const char* name : {"A", "B", "G", "R"})
+    {
+      channels += name;
+      channels += '\0';
+      channels += encodeInt(half ? 1 : 2); // pixel type: half or float
+      channels += std::string(4, '\0');    // pLinear and reserved
+      channels += encodeInt(1);            // x sampling
+      channels += encodeInt(1);            // y sampling
+    }
+    channels += '\0';
+    writeAttribute("channels", "chlist", channels);
+
+    std::string window = encodeInt(0) + encodeInt(0) + encodeInt(width - 1) + encodeInt(height - 1);
+    writeAttribute("compression", "compression", std::string(1, 0)); // none
+    writeAttribute("dataWindow", "box2i", window);
+    writeAttribute("displayWindow", "box2i", window);
+    writeAttribute("lineOrder", "lineOrder", std::string(1, 2)); // random: tiles in any order
+    writeAttribute("pixelAspectRatio", "float", encodeFloat(1));
+    writeAttribute("screenWindowCenter", "v2f", encodeFloat(0) + encodeFloat(0));
+    writeAttribute("screenWindowWidth", "float", encodeFloat(1));
+    writeAttribute("tiles", "tiledesc", encodeInt(tileSize) + encodeInt(tileSize) + std::string(1, 0)); // one level
+    file.put(0); // end of header
+
+    offsetTablePosition = file.tellp();
+    tileOffsets.assign(tilesX * tilesY, 0);
+    file.write(std::string(tileOffsets.size() * 8, '\0').data(), tileOffsets.size() * 8);
+
+    return bool(file);
+  }
+
+  // Writes the tile at (tileX, tileY) of the tile grid. rgba holds its pixels row by row.
+  void writeTile(int tileX, int tileY, const Framebuffer& rgba)
+  {
+    int tileWidth = std::min(tileSize, width - tileX * tileSize);
+    int tileHeight = std::min(tileSize, height - tileY * tileSize);
+
+    // each row holds all of its A values, then B, G and R
+    std::string data;
+    data.reserve(tileWidth * tileHeight * 4 * (half ? 2 : 4));
+    for (int y = 0; y < tileHeight; ++y)
+    {
+      for (int c : {3, 2, 1, 0})
+      {
+        for (int x = 0; x < tileWidth; ++x)
+        {
+          float value = rgba(y * tileWidth + x, c);
+          data += half ? encodeShort(Eigen::half(value).x) : encodeFloat(value);
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    tileOffsets[tileY * tilesX + tileX] = file.tellp();
+    writeInt(tileX);
+    writeInt(tileY);
+    writeInt(0); // level
+    writeInt(0);
+    writeInt(data.size());
+    file.write(data.data(), data.size());
+  }
+
+  // Fills in the tile offsets. Returns false if anything failed to be written.
+  bool close()
+  {
+    file.seekp(offsetTablePosition);
+    for (unsigned long long offset : tileOffsets)
+    {
+      file.write(encodeLong(offset).data(), 8);
+    }
+    file.close();
+    return !file.fail();
+  }
+
+  private:
+
+  // OpenEXR is little-endian whatever the machine.
+  static std::string encodeLong(unsigned long long value)
+  {
+    std::string bytes(8, '\0');
+    for (int i = 0; i < 8; ++i)
+    {
+      bytes[i] = char(value >> (8 * i));
+    }
+    return bytes;
+  }
+
+  static std::string encodeInt(unsigned int value)
+  {
+    return encodeLong(value).substr(0, 4);
+  }
+
+  static std::string encodeShort(unsigned short value)
+  {
+    return encodeLong(value).substr(0, 2);
+  }
+
+  static std::string encodeFloat(float value)
+  {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return encodeInt(bits);
+  }
+
+  void writeInt(unsigned int value)
+  {
+    file.write(encodeInt(value).data(), 4);
+  }
+
+  void writeAttribute(const std::string& name, const std::string& type, const std::string& value)
+  {
+    file.write(name.c_str(), name.size() + 1);
+    file.write(type.c_str(), type.size() + 1);
+    writeInt(value.size());
+    file.write(value.data(), value.size());
+  }
+};
+
+// A finished frame on its way to disk. It owns copies of its pixels, so the renderer can go
+// on with the next frame while it is written.
+struct EncodeJob
+{
+  std::string path;
+  ImageFormat format;
+  int width;
+  int height;
+  std::vector<Uint32> pixels; // ARGB display pixels, for PPM and PNG
+  Framebuffer color;          // RGBA row by row, for EXR
+  bool half;                  // EXR channels as 16 bit floats
+};
+
+// First in, first out queue with a fixed capacity, between threads. push() blocks while the queue
+// is full, which holds producers back to the speed of their consumers.
+template <typename T>
+class BoundedQueue
+{
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  std::deque<T> items;
+  int capacity;
+  bool closed = false;
+
+  public:
+
+  BoundedQueue(int pCapacity)
+  {
+    capacity = std::max(1, pCapacity);
+  }
+
+  void push(T item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [&]() { return int(items.size()) < capacity; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  // Blocks until there is an item. Returns false once the queue is closed and empty.
+  bool pop(T& item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [&]() { return !items.empty() || closed; });
+    if (items.empty())
+    {
+      return false;
+    }
+
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // Wakes up the consumers once the remaining items are taken, no more may be pushed.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+  }
+};
+
+// Hands the latest value from one producer thread to one consumer thread without locks. Of the
+// three buffers the producer writes one, the consumer reads another and the third holds the
+// newest complete value, which they swap with their own: the producer never waits for the
+// consumer, and the consumer skips the values it had no time for.
+template <typename T>
+class TripleBuffer
+{
+  static const int IndexMask = 3;
+  static const int Fresh = 4; // the middle buffer holds a value the consumer hasn't seen
+
+  T buffers[3];
+  int backIndex = 0;
+  int frontIndex = 1;
+  std::atomic<int> middle{2};
+
+  public:
+
+  // The buffer the producer fills before publish().
+  T& back()
+  {
+    return buffers[backIndex];
+  }
+
+  void publish()
+  {
+    backIndex = middle.exchange(backIndex | Fresh) & IndexMask;
+  }
+
+  // Makes the newest published value the front one. Returns false when nothing new was published.
+  bool acquire()
+  {
+    if (!(middle.load() & Fresh))
+    {
+      return false;
+    }
+
+    frontIndex = middle.exchange(frontIndex) & IndexMask;
+    return true;
+  }
+
+  // The buffer the consumer reads after acquire().
+  const T& front() const
+  {
+    return buffers[frontIndex];
+  }
+};
+
+// Encodes and writes frames on its own threads, so file formats and disk I/O never hold up
+// rendering. When the encoders fall behind, submit() waits for room in the queue instead of
+// piling up frames in memory.
+class ImageEncoder
+{
+  BoundedQueue<EncodeJob> queue;
+  std::vector<std::thread> threads;
+
+  public:
+
+  ImageEncoder(int threadCount, int queueSize)
+    : queue(queueSize)
+  {
+    for (int i = 0; i < std::max(1, threadCount); ++i)
+    {
+      threads.emplace_back([this]() { run(); });
+    }
+  }
+
+  // Writes the frames still queued before returning.
+  ~ImageEncoder()
+  {
+    queue.close();
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+  }
+
+  void submit(EncodeJob job)
+  {
+    queue.push(std::move(job));
+  }
+
+  static const char* extension(ImageFormat format)
+  {
+    return format == ImageFormat::Exr ? ".exr" : format == ImageFormat::Png ? ".png" : ".ppm";
+  }
+
+  private:
+
+  void run()
+  {
+    EncodeJob job;
+    while (queue.pop(job))
+    {
+      bool written;
+      if (job.format == ImageFormat::Exr)
+      {
+        written = writeExr(job);
+      }
+      else if (job.format == ImageFormat::Png)
+      {
+        written = writePng(job);
+      }
+      else
+      {
+        written = writePpm(job);
+      }
+
+      if (!written)
+      {
+        printf("Could not write %s\n", job.path.c_str());
+      }
+    }
+  }
+
+  static std::vector<unsigned char> rgbRow(const EncodeJob& job, int y)
+  {
+    std::vector<unsigned char> rgb(job.width * 3);
+    for (int x = 0; x < job.width; ++x)
+    {
+      Uint32 pixel = job.pixels[y * job.width + x];
+      rgb[x * 3] = pixel >> 16;
+      rgb[x * 3 + 1] = pixel >> 8;
+      rgb[x * 3 + 2] = pixel;
+    }
+    return rgb;
+  }
+
+  static bool writePpm(const EncodeJob& job)
+  {
+    std::ofstream file(job.path, std::ios::binary);
+    file << "P6\n" << job.width << " " << job.height << "\n255\n";
+
+    for (int y = 0; y < job.height; ++y)
+    {
+      std::vector<unsigned char> rgb = rgbRow(job, y);
+      file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+    }
+
+    return bool(file);
+  }
+
+  // 8 bit RGB PNG. The image data is a zlib stream of stored (uncompressed) deflate blocks,
+  // which every decoder reads and which needs no compression library.
+  static bool writePng(const EncodeJob& job)
+  {
+    std::string data;
+    data.reserve((job.width * 3 + 1) * job.height);
+    for (int y = 0; y < job.height; ++y)
+    {
+      std::vector<unsigned char> rgb = rgbRow(job, y);
+      data += '\0'; // no filter
+      data.append(rgb.begin(), rgb.end());
+    }
+
+    unsigned int adlerA = 1, adlerB = 0;
+    for (unsigned char byte : data)
+    {
+      adlerA = (adlerA + byte) % 65521;
+      adlerB = (adlerB + adlerA) % 65521;
+    }
+
+    std::string zlib = "\x78\x01";
+    for (size_t done = 0; done < data.size() || done == 0; )
+    {
+      size_t length = std::min<size_t>(data.size() - done, 65535);
+      bool last = done + length == data.size();
+      zlib += char(last ? 1 : 0);
+      zlib += char(length);
+      zlib += char(length >> 8);
+      zlib += char(~length);
+      zlib += char(~length >> 8);
+      zlib.append(data, done, length);
+      done += length;
+      if (last)
+      {
+        break;
+      }
+    }
+    zlib += bigEndian((adlerB << 16) | adlerA);
+
+    std::string header = bigEndian(job.width) + bigEndian(job.height);
+    header += "\x08\x02"; // 8 bits per channel, RGB
+    header += std::string(3, '\0'); // deflate, adaptive filtering, no interlace
+
+    std::ofstream file(job.path, std::ios::binary);
+    file.write("\x89PNG\r\n\x1a\n", 8);
+    writePngChunk(file, "IHDR", header);
+    writePngChunk(file, "IDAT", zlib);
+    writePngChunk(file, "IEND", "");
+
+    return bool(file);
+  }
+
+  static std::string bigEndian(unsigned int value)
+  {
+    std::string bytes(4, '\0');
+    for (int i = 0; i < 4; ++i)
+    {
+      bytes[i] = char(value >> (24 - 8 * i));
+    }
+    return bytes;
+  }
+
+  static void writePngChunk(std::ofstream& file, const std::string& type, const std::string& data)
+  {
+    static const std::vector<unsigned int> crcTable = []()
+    {
+      std::vector<unsigned int> table(256);
+      for (unsigned int n = 0; n < 256; ++n)
+      {
+        unsigned int c = n;
+        for (int k = 0; k < 8; ++k)
+        {
+          c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+      }
+      return table;
+    }();
+
+    std::string typeAndData = type + data;
+    unsigned int crc = 0xffffffffu;
+    for (unsigned char byte : typeAndData)
+    {
+      crc = crcTable[(crc ^ byte) & 0xff] ^ (crc >> 8);
+    }
+
+    file.write(bigEndian(data.size()).data(), 4);
+    file.write(typeAndData.data(), typeAndData.size());
+    file.write(bigEndian(crc ^ 0xffffffffu).data(), 4);
+  }
+
+  static bool writeExr(const EncodeJob& job)
+  {
+    TiledExrWriter writer;
+    if (!writer.open(job.path, job.width, job.height, FrameTileSize, job.half))
+    {
+      return false;
+    }
+
+    for (int tileY = 0; tileY * FrameTileSize < job.height; ++tileY)
+    {
+      for (int tileX = 0; tileX * FrameTileSize < job.width; ++tileX)
+      {
+        int tileWidth = std::min(FrameTileSize, job.width - tileX * FrameTileSize);
+        int tileHeight = std::min(FrameTileSize, job.height - tileY * FrameTileSize);
+
+        Framebuffer tile(tileWidth * tileHeight, 4);
+        for (int y = 0; y < tileHeight; ++y)
+        {
+          int first = (tileY * FrameTileSize + y) * job.width + tileX * FrameTileSize;
+          tile.middleRows(y * tileWidth, tileWidth) = job.color.middleRows(first, tileWidth);
+        }
+        writer.writeTile(tileX, tileY, tile);
+      }
+    }
+
+    return writer.close();
+  }
+};
+
+// Streams display frames to one file, a named pipe or stdout, for a video encoder to read
+// (e.g. ffmpeg -i - for Y4M, or -f rawvideo -pix_fmt rgb24 -s WxH for raw RGB), so a shot
+// needs no file per frame. Frames are converted and written in order on the sink's own
+// thread, behind a bounded queue: rendering only waits when the reader falls behind.
+class VideoSink
+{
+  FILE* file = nullptr;
+  VideoFormat format;
+  int width;
+  int height;
+  int frameRate;
+
+  BoundedQueue<std::vector<Uint32>> queue;
+  std::thread thread;
+
+  public:
+
+  VideoSink(const RenderSettings& pSettings)
+    : queue(pSettings.encodeQueueSize)
+  {
+    format = pSettings.videoFormat;
+    width = pSettings.width;
+    height = pSettings.height;
+    frameRate = pSettings.videoFrameRate;
+  }
+
+  // Writes to path, or to stdout for "-". In that case everything else the program prints to
+  // stdout goes to stderr instead, so it can't end up in the video.
+  bool open(const std::string& path)
+  {
+    if (path == "-")
+    {
+      fflush(stdout);
+      int videoOutput = dup(fileno(stdout));
+      dup2(fileno(stderr), fileno(stdout));
+      file = videoOutput >= 0 ? fdopen(videoOutput, "wb") : nullptr;
+    }
+    else
+    {
+      file = fopen(path.c_str(), "wb");
+    }
+
+    if (!file)
+    {
+      return false;
+    }
+
+    if (format == VideoFormat::Y4m)
+    {
+      fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, frameRate);
+    }
+    thread = std::thread([this]() { run(); });
+    return true;
+  }
+
+  // Writes the frames still queued before returning.
+  ~VideoSink()
+  {
+    queue.close();
+    if (thread.joinable())
+    {
+      thread.join();
+    }
+    if (file)
+    {
+      fclose(file);
+    }
+  }
+
+  // pixels are a frame after DisplayResolve.
+  void submit(const std::vector<Uint32>& pixels)
+  {
+    queue.push(pixels);
+  }
+
+  private:
+
+  void run()
+  {
+    std::vector<Uint32> pixels;
+    std::vector<unsigned char> planes(3 * width * height);
+
+    while (queue.pop(pixels))
+    {
+      if (format == VideoFormat::Y4m)
+      {
+        convertToYuv(pixels, planes);
+        fputs("FRAME\n", file);
+      }
+      else
+      {
+        for (int i = 0; i < width * height; ++i)
+        {
+          planes[3 * i] = pixels[i] >> 16;
+          planes[3 * i + 1] = pixels[i] >> 8;
+          planes[3 * i + 2] = pixels[i];
+        }
+      }
+      fwrite(planes.data(), 1, planes.size(), file);
+    }
+    fflush(file);
+  }
+
+  // Y, U and V planes one after the other. Every row is converted with one 3x3 matrix
+  // product, which Eigen vectorises.
+  void convertToYuv(const std::vector<Uint32>& pixels, std::vector<unsigned char>& planes) const
+  {
+    Eigen::Matrix3f rgbToYuv;
+    rgbToYuv <<
+       0.257f,  0.504f,  0.098f,
+      -0.148f, -0.291f,  0.439f,
+       0.439f, -0.368f, -0.071f;
+    Eigen::Vector3f offset(16.5f, 128.5f, 128.5f); // and + 0.5 to round
+
+    parallelFor(0, height, [&](int y)
+    {
+      Eigen::Matrix<float, 3, Eigen::Dynamic> rgb(3, width);
+      for (int x = 0; x < width; ++x)
+      {
+        Uint32 pixel = pixels[y * width + x];
+        rgb.col(x) << ((pixel >> 16) & 0xff), ((pixel >> 8) & 0xff), (pixel & 0xff);
+      }
+
+      Eigen::Matrix<float, 3, Eigen::Dynamic> yuv = (rgbToYuv * rgb).colwise() + offset;
+      Eigen::Array<unsigned char, 3, Eigen::Dynamic> bytes = yuv.array().max(0.0f).min(255.0f).cast<unsigned char>();
+
+      for (int plane = 0; plane < 3; ++plane)
+      {
+        Eigen::Map<Eigen::Array<unsigned char, 1, Eigen::Dynamic>>(planes.data() + (plane * height + y) * width, width) = bytes.row(plane);
+      }
+    });
+  }
+};
+
+// The job that saves frame number frameNumber to settings.savePrefix_<frameNumber> in
+// settings.saveFormat. pixels are the frame after DisplayResolve.
+EncodeJob createEncodeJob(const RenderSettings& settings, int frameNumber, const FrameStore& frame, const std::vector<Uint32>& pixels)
+{
+  char number[16];
+  snprintf(number, sizeof(number), "_%04d", frameNumber);
+
+  EncodeJob job;
+  job.path = settings.savePrefix + number + ImageEncoder::extension(settings.saveFormat);
+  job.format = settings.saveFormat;
+  job.width = settings.width;
+  job.height = settings.height;
+  job.half = settings.halfFloat;
+
+  if (settings.saveFormat == ImageFormat::Exr)
+  {
+    job.color.resize(settings.width * settings.height, 4);
+    parallelFor(0, settings.height, [&](int y)
+    {
+      Framebuffer row;
+      frame.read(0, y, settings.width, row);
+      job.color.middleRows(y * settings.width, settings.width) = row;
+    });
+  }
+  else
+  {
+    job.pixels = pixels;
+  }
+
+  return job;
+}
+
+// Converts a Framebuffer to 8 bit ARGB display pixels in one streaming pass over the rows:
+// exposure and tone mapping run on whole rows with Eigen, the output encoding goes through a
+// lookup table, and optional dithering (triangular, up to one step either way) hides banding.
+class DisplayResolve
+{
+  static const int LutSize = 4096;
+
+  float exposureScale;
+  ToneMap toneMap;
+  bool dither;
+  std::vector<float> encodeTable; // 0-255 output value for LutSize steps of [0, 1]
+
+  public:
+
+  DisplayResolve(const RenderSettings& pSettings)
+  {
+    exposureScale = pow(2.0, pSettings.exposure);
+    toneMap = pSettings.toneMap;
+    dither = pSettings.dither;
+
+    encodeTable.resize(LutSize);
+    for (int i = 0; i < LutSize; ++i)
+    {
+      double value = double(i) / (LutSize - 1);
+      if (pSettings.srgbOutput)
+      {
+        value = value <= 0.0031308 ? 12.92 * value : 1.055 * pow(value, 1 / 2.4) - 0.055;
+      }
+      encodeTable[i] = 255 * value;
+    }
+  }
+
+  void resolve(const FrameStore& frame, std::vector<Uint32>& pixels) const
+  {
+    int width = frame.width;
+    int height = frame.height;
+
+    parallelFor(0, height, [&](int y)
+    {
+      Framebuffer row;
+      frame.read(0, y, width, row);
+      Eigen::Array<float, Eigen::Dynamic, 3> color = row.leftCols(3) * exposureScale;
+
+      if (toneMap == ToneMap::Reinhard)
+      {
+        color = color / (1 + color);
+      }
+      else if (toneMap == ToneMap::ACES)
+      {
+        color = (color * (2.51f * color + 0.03f)) / (color * (2.43f * color + 0.59f) + 0.14f);
+      }
+
+      Eigen::Array<int, Eigen::Dynamic, 3> step = (color.max(0.0f).min(1.0f) * (LutSize - 1) + 0.5f).cast<int>();
+
+      for (int x = 0; x < width; ++x)
+      {
+        float noise = 0.5f;
+        if (dither)
+        {
+          unsigned int hash = mixBits(y * width + x);
+          noise += (hash & 0xffff) * 0x1p-16f - (hash >> 16) * 0x1p-16f;
+        }
+
+        Uint32 pixel = 0xff000000u;
+        for (int c = 0; c < 3; ++c)
+        {
+          int value = std::min(std::max(int(encodeTable[step(x, c)] + noise), 0), 255);
+          pixel |= value << (16 - 8 * c);
+        }
+        pixels[y * width + x] = pixel;
+      }
+    });
+  }
+};
+
+// Where the camera, or an object relative to where it was created, is at one frame of an animation.
+struct Keyframe
+{
+  double frame;
+  Eigen::Vector3d translation;
+  Eigen::Quaterniond rotation;
+};
+
+// Keyframes of the camera or of one object. Between two keyframes the translation is
+// interpolated linearly and the rotation with slerp; before the first and after the last one
+// it holds still.
+class Track
+{
+  public:
+  std::vector<Keyframe> keyframes; // by frame
+
+  void add(const Keyframe& keyframe)
+  {
+    auto after = std::upper_bound(keyframes.begin(), keyframes.end(), keyframe.frame,
+      [](double frame, const Keyframe& other) { return frame < other.frame; });
+    keyframes.insert(after, keyframe);
+  }
+
+  Keyframe at(double frame) const
+  {
+    if (frame <= keyframes.front().frame)
+    {
+      return keyframes.front();
+    }
+    if (frame >= keyframes.back().frame)
+    {
+      return keyframes.back();
+    }
+
+    int next = 1;
+    while (keyframes[next].frame < frame)
+    {
+      next++;
+    }
+    const Keyframe& a = keyframes[next - 1];
+    const Keyframe& b = keyframes[next];
+    double t = (frame - a.frame) / (b.frame - a.frame);
+
+    Keyframe result;
+    result.frame = frame;
+    result.translation = (1 - t) * a.translation + t * b.translation;
+    result.rotation = a.rotation.slerp(t, b.rotation);
+    return result;
+  }
+};
+
+// Camera and object motion of a frame sequence, see SequenceRenderer.
+class Animation
+{
+  public:
+  Track camera;
+  std::vector<Track> objects; // by index in World::sceneObjects, objects without keyframes stay put
+
+  // Text file with one keyframe per line, blank lines and lines starting with # are skipped:
+  //   camera <frame> <x> <y> <z> [<yaw> <pitch> <roll>]
+  //   object <index> <frame> <x> <y> <z> [<yaw> <pitch> <roll>]
+  // The camera gets its position, an object the translation added to where it was created.
+  // Angles are in degrees, around the Y, X and Z axes in that order.
+  bool load(const std::string& path)
+  {
+    std::ifstream file(path);
+    if (!file)
+    {
+      return false;
+    }
+
+    camera = Track();
+    objects.clear();
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream fields(line);
+      std::string target;
+      if (!(fields >> target) || target[0] == '#')
+      {
+        continue;
+      }
+
+      int index = 0;
+      if (target == "object" && !(fields >> index && index >= 0))
+      {
+        return false;
+      }
+      else if (target != "object" && target != "camera")
+      {
+        return false;
+      }
+
+      Keyframe keyframe;
+      double x, y, z;
+      if (!(fields >> keyframe.frame >> x >> y >> z))
+      {
+        return false;
+      }
+      keyframe.translation = Eigen::Vector3d(x, y, z);
+
+      double yaw = 0, pitch = 0, roll = 0;
+      fields >> yaw >> pitch >> roll;
+      keyframe.rotation = rotationFromAngles(yaw, pitch, roll);
+
+      if (target == "camera")
+      {
+        camera.add(keyframe);
+      }
+      else
+      {
+        objects.resize(std::max<int>(objects.size(), index + 1));
+        objects[index].add(keyframe);
+      }
+    }
+
+    return true;
+  }
+
+  // Used without an animation file: the camera slides to the right and turns back towards
+  // the spheres, while the front sphere bobs up and down.
+  static Animation demo(int frames)
+  {
+    double last = std::max(1, frames - 1);
+
+    Animation animation;
+    animation.camera.add({0, Eigen::Vector3d(0, 0, 0.5), rotationFromAngles(0, 0, 0)});
+    animation.camera.add({last, Eigen::Vector3d(1.5, 0, 0.5), rotationFromAngles(8, 0, 0)});
+
+    animation.objects.resize(1);
+    animation.objects[0].add({0, Eigen::Vector3d::Zero(), rotationFromAngles(0, 0, 0)});
+    animation.objects[0].add({last / 2, Eigen::Vector3d(0, -0.6, 0), rotationFromAngles(0, 0, 0)});
+    animation.objects[0].add({last, Eigen::Vector3d::Zero(), rotationFromAngles(0, 0, 0)});
+    return animation;
+  }
+
+  // Poses the world's objects and the camera for a frame.
+  void apply(double frame, World& world, Camera& pCamera) const
+  {
+    for (int i = 0; i < int(objects.size()) && i < int(world.sceneObjects.size()); ++i)
+    {
+      if (!objects[i].keyframes.empty())
+      {
+        Keyframe pose = objects[i].at(frame);
+        world.sceneObjects[i]->setTransform(pose.translation, pose.rotation);
+      }
+    }
+    world.geometryVersion++;
+
+    if (!camera.keyframes.empty())
+    {
+      Keyframe pose = camera.at(frame);
+      pCamera.pos = pose.translation;
+      pCamera.orientation = pose.rotation;
+    }
+  }
+
+  private:
+
+  static Eigen::Quaterniond rotationFromAngles(double yaw, double pitch, double roll)
+  {
+    double toRadians = M_PI / 180;
+    return
+      Eigen::AngleAxisd(yaw * toRadians, Eigen::Vector3d::UnitY()) *
+      Eigen::AngleAxisd(pitch * toRadians, Eigen::Vector3d::UnitX()) *
+      Eigen::AngleAxisd(roll * toRadians, Eigen::Vector3d::UnitZ());
+  }
+};
+
+// Renders single tiles of the image: traces a tile's primary rays into its G-buffer and takes
+// its samples. Used by the interactive Renderer, which keeps every tile's hits for relighting,
+// and by streamToFile, which only keeps the tiles being worked on.
+class TileRenderer
+{
+  public:
+
+  // Pixel step of the tiles renderTile starts after the time budget has run out.
+  static const int CoarseStep = 4;
+
+  World* world;
+  RenderSettings settings;
+  Integrator* integrator;
+  Camera camera;
+
+  TileRenderer(World* pWorld, const RenderSettings& pSettings)
+    : settings(pSettings), camera(pSettings.width, pSettings.height)
+  {
+    world = pWorld;
+
+    if (settings.integrator == IntegratorType::PathTracer)
+    {
+      integrator = new PathTracer(world, settings);
+    }
+    else
+    {
+      integrator = new DirectLighting(world, settings);
+    }
+  }
+
+  ~TileRenderer()
+  {
+    delete integrator;
+  }
+
+  // The image is split in tiles of settings.tileSize pixels, by rows of tiles.
+  int tilesX() const
+  {
+    return (settings.width + settings.tileSize - 1) / settings.tileSize;
+  }
+
+  int tileCount() const
+  {
+    return tilesX() * ((settings.height + settings.tileSize - 1) / settings.tileSize);
+  }
+
+  GBuffer createTile(int tile) const
+  {
+    int x = tile % tilesX() * settings.tileSize;
+    int y = tile / tilesX() * settings.tileSize;
+    return GBuffer(x, y, std::min(settings.tileSize, settings.width - x), std::min(settings.tileSize, settings.height - y));
+  }
+
+  // First pass: find what every pixel of a tile sees and store it in its G-buffer. No shading here.
+  // With one sample per pixel the ray goes through the pixel's corner, otherwise each sample
+  // goes through a point of the pixel picked by the sampler (anti-aliasing).
+  // With step > 1 only the pixels whose screen coordinates are both multiples of step are
+  // traced, and those that are multiples of tracedStep as well are skipped, since a coarser
+  // pass already traced them (see Renderer::render).
+  void tracePrimaryRays(GBuffer& gbuffer, int sampleIndex, int step = 1, int tracedStep = 0)
+  {
+    double screenSpaceXRatio = 1.0 / settings.width;
+    double screenSpaceYRatio = 1.0 / settings.height;
+
+    Sampler sampler(settings.sampler, settings.samplesPerPixel, std::max(settings.width, settings.height));
+    bool jitter = settings.samplesPerPixel > 1;
+
+    int firstX = (step - gbuffer.originX % step) % step;
+    int firstY = (step - gbuffer.originY % step) % step;
+    for (int y = firstY; y < gbuffer.height; y += step)
+    {
+      int screenY = gbuffer.originY + y;
+      for (int x = firstX; x < gbuffer.width; x += step)
+      {
+        int screenX = gbuffer.originX + x;
+        if (tracedStep > 0 && screenX % tracedStep == 0 && screenY % tracedStep == 0)
+        {
+          continue;
+        }
+
+        Eigen::Vector2d offset = Eigen::Vector2d::Zero();
+        if (jitter)
+        {
+          sampler.startPixelSample(gbuffer.originX + x, gbuffer.originY + y, sampleIndex);
+          offset = sampler.get2D();
+        }
+
+        double screenSpaceX = screenSpaceXRatio * (gbuffer.originX + x + offset.x());
+        double screenSpaceY = screenSpaceYRatio * (gbuffer.originY + y + offset.y());
+        Ray ray = camera.RayAtScreenSpace(screenSpaceX, screenSpaceY);
+
+        gbuffer.write(gbuffer.index(x, y), ray, world->findClosestHit(ray));
+      }
+    }
+  }
+
+  // Traces the pixels x of a G-buffer of one screen row for which traced[x] is set, through
+  // their corners. The others are written as misses along their rays, without tracing them, so
+  // that shading them only costs a background lookup.
+  void traceRowPixels(GBuffer& row, const char* traced)
+  {
+    RayHitResult miss = {};
+
+    for (int x = 0; x < row.width; ++x)
+    {
+      double screenSpaceX = double(row.originX + x) / settings.width;
+      double screenSpaceY = double(row.originY) / settings.height;
+      Ray ray = camera.RayAtScreenSpace(screenSpaceX, screenSpaceY);
+      row.write(x, ray, traced[x] ? world->findClosestHit(ray) : miss);
+    }
+  }
+
+  // Samples a tile until it has targetSamples samples. cachedHits are the primary hits of
+  // sample 0; with several samples per pixel every other sample looks through a different
+  // point of the pixel and needs its own primary rays.
+  void sampleTile(const GBuffer& cachedHits, TileAccumulator& accumulator, int targetSamples)
+  {
+    GBuffer jitteredHits(cachedHits.originX, cachedHits.originY, cachedHits.width, cachedHits.height);
+
+    Eigen::ArrayX3d color(cachedHits.depth.size(), 3);
+    while (accumulator.samples < targetSamples)
+    {
+      if (accumulator.samples == 0)
+      {
+        integrator->shade(cachedHits, 0, color);
+      }
+      else
+      {
+        tracePrimaryRays(jitteredHits, accumulator.samples);
+        integrator->shade(jitteredHits, accumulator.samples, color);
+      }
+      accumulator.add(color);
+    }
+  }
+
+  // With adaptive sampling, every round doubles the samples of the tiles that are still
+  // noisy, so the budget goes where the noise is. With a time budget rounds double the samples
+  // too, so that there is an image to show whenever time runs out. Otherwise a tile takes all
+  // its samples at once.
+  int nextSampleCount(const TileAccumulator& accumulator) const
+  {
+    if (settings.adaptiveThreshold > 0 || settings.timeBudgetMs > 0)
+    {
+      return std::min(settings.samplesPerPixel, std::max(1, 2 * accumulator.samples));
+    }
+    return settings.samplesPerPixel;
+  }
+
+  // A tile is done once it has settings.samplesPerPixel samples or its error estimate is below
+  // settings.adaptiveThreshold. Tiles that only see the background are done after one sample.
+  bool tileDone(const GBuffer& hits, const TileAccumulator& accumulator) const
+  {
+    return
+      accumulator.samples >= settings.samplesPerPixel ||
+      !hits.hasHits() ||
+      accumulator.error() < settings.adaptiveThreshold;
+  }
+
+  // Shades one sample of the hits on every step-th row and column of gbuffer, already traced,
+  // into color, which gets a row per pixel of gbuffer, each the colour of the nearest of those.
+  // Returns false if no such row and column crosses the tile.
+  bool shadeCoarse(const GBuffer& gbuffer, int step, Eigen::ArrayX3d& color) const
+  {
+    GBuffer coarse = gbuffer.subsample(step);
+    if (coarse.width == 0 || coarse.height == 0)
+    {
+      return false;
+    }
+
+    Eigen::ArrayX3d coarseColor(coarse.depth.size(), 3);
+    integrator->shade(coarse, 0, coarseColor);
+    fillCoarse(gbuffer, coarse, step, coarseColor, color);
+    return true;
+  }
+
+  // Gives every pixel of gbuffer the colour coarseColor has for the nearest of the pixels in
+  // coarse, gbuffer.subsample(step), into color.
+  static void fillCoarse(const GBuffer& gbuffer, const GBuffer& coarse, int step, const Eigen::ArrayX3d& coarseColor, Eigen::ArrayX3d& color)
+  {
+    color.resize(gbuffer.depth.size(), 3);
+    for (int y = 0; y < gbuffer.height; ++y)
+    {
+      int coarseY = std::min(std::max(0, (gbuffer.originY + y) / step - coarse.originY), coarse.height - 1);
+      for (int x = 0; x < gbuffer.width; ++x)
+      {
+        int coarseX = std::min(std::max(0, (gbuffer.originX + x) / step - coarse.originX), coarse.width - 1);
+        color.row(gbuffer.index(x, y)) = coarseColor.row(coarse.index(coarseX, coarseY));
+      }
+    }
+  }
+
+  // Traces and samples a whole tile, on its own. With settings.timeBudgetMs, a round of samples
+  // only starts if, at the pace of the earlier ones, it will be done by deadline (see
+  // TileBudget), and a tile that starts after the deadline is only traced and shaded on every
+  // CoarseStep-th row and column (see shadeCoarse). Returns false for such a coarse tile.
+  bool renderTile(GBuffer& gbuffer, TileAccumulator& accumulator, std::chrono::steady_clock::time_point deadline = {})
+  {
+    bool budgeted = settings.timeBudgetMs > 0;
+    accumulator.reset(gbuffer.depth.size());
+
+    if (budgeted && std::chrono::steady_clock::now() >= deadline)
+    {
+      Eigen::ArrayX3d color;
+      tracePrimaryRays(gbuffer, 0, CoarseStep);
+      if (shadeCoarse(gbuffer, CoarseStep, color))
+      {
+        accumulator.add(color);
+        return false;
+      }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    tracePrimaryRays(gbuffer, 0);
+    double traceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double firstSeconds = 0;
+    double laterSeconds = 0;
+    do
+    {
+      int targetSamples = nextSampleCount(accumulator);
+      auto roundStart = std::chrono::steady_clock::now();
+      if (budgeted && accumulator.samples > 0)
+      {
+        // the first sample is always taken, so that every pixel has a colour
+        double expected = (targetSamples - accumulator.samples) * secondsPerLaterSample(accumulator.samples, traceSeconds, firstSeconds, laterSeconds);
+        if (roundStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(expected)) > deadline)
+        {
+          break;
+        }
+      }
+      sampleTile(gbuffer, accumulator, targetSamples);
+      (targetSamples == 1 ? firstSeconds : laterSeconds) += std::chrono::duration<double>(std::chrono::steady_clock::now() - roundStart).count();
+    }
+    while (!tileDone(gbuffer, accumulator));
+    return true;
+  }
+
+  // The time a sample after the first takes in a tile that has the given samples. The first
+  // sample shades the traced hits, which took traceSeconds to trace, in firstSeconds, and every
+  // later one traces its own primary rays; laterSeconds is the time the later ones took so far.
+  static double secondsPerLaterSample(int samples, double traceSeconds, double firstSeconds, double laterSeconds)
+  {
+    return samples > 1 ? laterSeconds / (samples - 1) : traceSeconds + firstSeconds;
+  }
+};
+
+// Spreads a time budget over the tiles of an image rendered one by one with
+// TileRenderer::renderTile. The clock starts with the first tile, and every tile gets an even
+// share of the time left, workers tiles being rendered at once. Not thread safe.
+struct TileBudget
+{
+  int budgetMs;
+  int tilesLeft;
+  int workers;
+  bool started = false;
+  std::chrono::steady_clock::time_point deadline; // of the image
+
+  TileBudget(int pBudgetMs, int tiles, int pWorkers)
+  {
+    budgetMs = pBudgetMs;
+    tilesLeft = tiles;
+    workers = pWorkers;
+  }
+
+  // The deadline of the tile starting now, the image's once it has passed.
+  std::chrono::steady_clock::time_point startTile()
+  {
+    auto now = std::chrono::steady_clock::now();
+    if (!started)
+    {
+      started = true;
+      deadline = now + std::chrono::milliseconds(budgetMs);
+    }
+
+    int rounds = (tilesLeft + workers - 1) / workers;
+    tilesLeft--;
+    return now < deadline ? now + (deadline - now) / std::max(1, rounds) : deadline;
+  }
+};
+
+// Renders straight to a tiled OpenEXR file at settings.streamPath, without a window. Each tile is
+// traced, sampled, written and dropped, so memory holds the tiles in flight, one per thread,
+// whatever the size of the image. The file holds linear HDR colour, before exposure and tone
+// mapping. settings.timeBudgetMs is spread over the tiles with a TileBudget.
+bool streamToFile(World& world, const RenderSettings& settings)
+{
+  TiledExrWriter writer;
+  if (!writer.open(settings.streamPath, settings.width, settings.height, settings.tileSize, settings.halfFloat))
+  {
+    return false;
+  }
+
+  TileRenderer tileRenderer(&world, settings);
+  tileRenderer.integrator->beginFrame();
+
+  TileBudget budget(settings.timeBudgetMs, tileRenderer.tileCount(), parallelThreadCount());
+  std::mutex budgetMutex;
+  std::vector<char> coarse(tileRenderer.tileCount(), false);
+  parallelFor(0, tileRenderer.tileCount(), [&](int tile)
+  {
+    std::unique_lock<std::mutex> lock(budgetMutex);
+    auto deadline = budget.startTile();
+    lock.unlock();
+
+    GBuffer gbuffer = tileRenderer.createTile(tile);
+    TileAccumulator accumulator;
+    coarse[tile] = !tileRenderer.renderTile(gbuffer, accumulator, deadline);
+
+    Framebuffer rgba(gbuffer.depth.size(), 4);
+    rgba.leftCols(3) = (accumulator.mean() / 255).cast<float>();
+    rgba.col(3).setOnes();
+    writer.writeTile(gbuffer.originX / settings.tileSize, gbuffer.originY / settings.tileSize, rgba);
+  });
+
+  int coarseTiles = std::count(coarse.begin(), coarse.end(), true);
+  if (coarseTiles > 0)
+  {
+    printf("The time budget ran out before %d of %d tiles, they were rendered at 1/%d resolution\n", coarseTiles, tileRenderer.tileCount(), TileRenderer::CoarseStep);
+  }
+
+  return writer.close();
+}
+
+// Renders settings.frames frames of an animation without a window and saves them with an
+// ImageEncoder. Frames are rendered in batches, and the tiles of all frames of a batch are
+// spread over the threads. One frame per batch needs the least memory and suits heavy frames.
+// As many frames as threads hands each thread whole frames, so that cheap frames don't leave
+// threads idle at every frame boundary. Every frame in flight has its own copy of the scene
+// (objects only, the environment map is shared) and its own FrameStore. While a batch is
+// traced, another thread poses the copies of the next batch and builds their light samplers.
+class SequenceRenderer
+{
+  // FrameScheduling::Auto renders frames slower than this one at a time.
+  static constexpr double HeavyFrameSeconds = 0.25;
+
+  struct FrameSlot
+  {
+    World* scene;
+    TileRenderer* tileRenderer;
+    FrameStore* frame;
+  };
+
+  World* world;
+  RenderSettings settings;
+  const Animation* animation;
+
+  std::vector<FrameSlot> slots; // two batches: one is traced while the other is posed
+  bool wholeFrames = false;     // each frame of a batch goes to one thread, instead of each tile
+  DisplayResolve display;
+  std::vector<Uint32> pixels;
+  ImageEncoder* encoder = nullptr; // only with settings.savePrefix
+
+  public:
+
+  VideoSink* video = nullptr; // frames are also streamed here when set
+
+  SequenceRenderer(World* pWorld, const RenderSettings& pSettings, const Animation* pAnimation)
+    : settings(pSettings), display(pSettings)
+  {
+    world = pWorld;
+    animation = pAnimation;
+    pixels.resize(settings.width * settings.height);
+
+    if (!settings.savePrefix.empty())
+    {
+      encoder = new ImageEncoder(settings.encoderThreads, settings.encodeQueueSize);
+    }
+  }
+
+  ~SequenceRenderer()
+  {
+    delete encoder;
+
+    for (FrameSlot& slot : slots)
+    {
+      delete slot.tileRenderer;
+      delete slot.scene;
+      delete slot.frame;
+    }
+  }
+
+  void render()
+  {
+    addSlots(1);
+    int first = 0;
+    int framesInFlight = settings.framesInFlight;
+
+    if (settings.frameScheduling == FrameScheduling::Auto)
+    {
+      // the first frame on its own tells what a frame costs
+      auto start = std::chrono::steady_clock::now();
+      prepareBatch(0, 0, 1);
+      renderBatch(0, 0, 1);
+      std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+      wholeFrames = seconds.count() < HeavyFrameSeconds;
+      framesInFlight = wholeFrames ? parallelThreadCount() : 1;
+      first = 1;
+    }
+    else if (settings.frameScheduling == FrameScheduling::Tiles)
+    {
+      framesInFlight = 1;
+    }
+    else if (settings.frameScheduling == FrameScheduling::Frames)
+    {
+      wholeFrames = true;
+      framesInFlight = parallelThreadCount();
+    }
+
+    long long memoryBudget = settings.sequenceMemoryMB * (1ll << 20);
+    int framesInBudget = std::max<long long>(1, memoryBudget / (2 * slots[0].frame->bytes()));
+    framesInFlight = std::max(1, std::min({framesInFlight, framesInBudget, settings.frames - first}));
+    std::cout << "rendering " << framesInFlight << " frames at a time" << std::endl;
+
+    addSlots(2 * framesInFlight);
+
+    int count = std::min(framesInFlight, settings.frames - first);
+    prepareBatch(0, first, count);
+    for (int batch = 0; first < settings.frames; ++batch)
+    {
+      int next = first + count;
+      int nextCount = std::min(framesInFlight, settings.frames - next);
+      int nextSlot = (batch + 1) % 2 * framesInFlight;
+
+      std::thread nextBatch;
+      if (nextCount > 0)
+      {
+        nextBatch = std::thread([&]()
+        {
+          JobScope scope({JobPriority::Background, nullptr}); // uses the threads renderBatch leaves idle
+          prepareBatch(nextSlot, next, nextCount);
+        });
+      }
+
+      renderBatch(batch % 2 * framesInFlight, first, count);
+
+      if (nextBatch.joinable())
+      {
+        nextBatch.join();
+      }
+      first = next;
+      count = nextCount;
+    }
+  }
+
+  private:
+
+  void addSlots(int count)
+  {
+    while (int(slots.size()) < count)
+    {
+      FrameSlot slot;
+      slot.scene = world->clone();
+      slot.tileRenderer = new TileRenderer(slot.scene, settings);
+      slot.frame = new FrameStore(settings.halfFloat, settings.width, settings.height);
+      slots.push_back(slot);
+    }
+  }
+
+  // Poses the scenes of slots [firstSlot, firstSlot + count) for frames [first, first + count).
+  void prepareBatch(int firstSlot, int first, int count)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      TileRenderer& tileRenderer = *slots[firstSlot + i].tileRenderer;
+      animation->apply(first + i, *tileRenderer.world, tileRenderer.camera);
+      tileRenderer.integrator->beginFrame();
+    }
+  }
+
+  void renderBatch(int firstSlot, int first, int count)
+  {
+    int tiles = slots[firstSlot].tileRenderer->tileCount();
+
+    // every frame has all of settings.timeBudgetMs, from its first tile on
+    std::vector<TileBudget> budgets(count, TileBudget(settings.timeBudgetMs, tiles, wholeFrames ? 1 : parallelThreadCount()));
+    std::mutex budgetMutex;
+    std::vector<char> coarse(count * tiles, false);
+
+    auto renderSlotTile = [&](int i, int tile)
+    {
+      std::unique_lock<std::mutex> lock(budgetMutex);
+      auto deadline = budgets[i].startTile();
+      lock.unlock();
+
+      FrameSlot& slot = slots[firstSlot + i];
+      GBuffer gbuffer = slot.tileRenderer->createTile(tile);
+      TileAccumulator accumulator;
+      coarse[i * tiles + tile] = !slot.tileRenderer->renderTile(gbuffer, accumulator, deadline);
+      slot.frame->writeTile(gbuffer, accumulator.mean());
+    };
+
+    if (wholeFrames)
+    {
+      // one pool item per frame, whose thread renders all of its tiles
+      parallelFor(0, count, [&](int i)
+      {
+        for (int tile = 0; tile < tiles; ++tile)
+        {
+          renderSlotTile(i, tile);
+        }
+      });
+    }
+    else
+    {
+      parallelFor(0, count * tiles, [&](int i)
+      {
+        renderSlotTile(i / tiles, i % tiles);
+      });
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+      const FrameStore& frame = *slots[firstSlot + i].frame;
+      display.resolve(frame, pixels);
+      if (encoder)
+      {
+        encoder->submit(createEncodeJob(settings, first + i, frame, pixels));
+      }
+      if (video)
+      {
+        video->submit(pixels);
+      }
+      std::cout << "frame " << first + i + 1 << " of " << settings.frames << " done";
+      int coarseTiles = std::count(coarse.begin() + i * tiles, coarse.begin() + (i + 1) * tiles, true);
+      if (coarseTiles > 0)
+      {
+        std::cout << ", the time budget ran out before " << coarseTiles << " of " << tiles << " tiles, rendered at 1/" << TileRenderer::CoarseStep << " resolution";
+      }
+      std::cout << std::endl;
+    }
+  }
+};
+
+class Renderer
+{
+  public:
+
+  SDL_Window *window;
+  int windowIndex;
+  SDL_Renderer* sdl_renderer;
+  SDL_Texture* texture;
+
+  World* world;
+  RenderSettings settings;
+  TileRenderer tileRenderer;
+
+  // The screen is split in tiles of settings.tileSize pixels, each with its own G-buffer and
+  // sample statistics. Primary visibility is cached between renders: while only the lights
+  // change we can skip the trace pass entirely and go straight to shading (relighting).
+  std::vector<GBuffer> primaryHits;
+  std::vector<TileAccumulator> accumulators;
+  int cameraVersion = 0; // bumped by setCamera
+
+  // The cached hits are valid on every tracedStep-th row and column of the screen (everywhere
+  // with 1, nowhere with 0), for these versions of the world and the camera.
+  int tracedStep = 0;
+  int tracedGeometryVersion = -1;
+  int tracedCameraVersion = -1;
+
+  // Pixel step of the frames rendered while the view keeps changing, see renderMotionFrame.
+  static const int MaxMotionStep = 16;
+  int motionStep = 4;
+
+  // For settings.timeBudgetMs: when the render in flight started, and the pace of the last
+  // trace pass, preview shading, preview write and present, AOV save, denoise and frame finish
+  // (see finishingSeconds), from which the next ones are predicted. The last two are -1 until
+  // measured.
+  std::chrono::steady_clock::time_point renderStart;
+  double traceSecondsPerPixel = 0;
+  double shadeSecondsPerPixel = 0;
+  double presentSeconds = 0;
+  double aovSeconds = 0;
+  double denoiseSeconds = -1;
+  double finishSeconds = -1;
+
+  // What every pixel of the last frame saw and its colour, row by row, for reprojectMotionFrame.
+  // Valid for these versions of the world.
+  Eigen::ArrayX3d historyPosition;
+  Eigen::ArrayXi historyObjectId; // -1 on a miss, whose position is BackgroundDistance along the ray
+  Framebuffer historyColor;
+  int historyGeometryVersion = -1;
+  int historyLightsVersion = -1;
+  int motionFrames = 0; // picks the pixels reprojectMotionFrame refreshes
+  int reprojectedCameraVersion = -1; // cameraVersion of the last frame reprojectMotionFrame showed
+  static constexpr double BackgroundDistance = 1e6;
+
+  FrameStore frame;
+  AovBuffers aovBuffers;
+  Denoiser denoiser;
+  DisplayResolve display;
+  std::vector<Uint32> pixels; // frame after DisplayResolve, uploaded to texture
+
+  ImageEncoder* encoder = nullptr; // only with settings.savePrefix
+  int savedFrames = 0;
+  VideoSink* video = nullptr; // presented frames are also streamed here when set
+
+  // render() runs on its own thread (see startRender) so the main thread stays free for input
+  // and for presenting. SDL may only be used from the main thread, so frames are handed over in
+  // displayBuffers and shown when the main thread gets a frameReadyEvent. Neither side ever waits
+  // for the other: a slow (e.g. vsync bound) present only means some frames are never shown.
+  std::thread renderThread;
+  std::atomic<bool> presentedSinceStart{false}; // the render in flight has presented a frame or a preview
+  std::atomic<bool> cancelled{false};
+  TripleBuffer<std::vector<Uint32>> displayBuffers;
+  std::atomic<bool> frameReadyPending{false}; // a frameReadyEvent is queued and not handled yet
+  Uint32 frameReadyEvent;
+
+  Renderer(SDL_Window *window, World *pWorld, const RenderSettings& pSettings)
+    : settings(pSettings), tileRenderer(pWorld, pSettings),
+      frame(pSettings.halfFloat, pSettings.width, pSettings.height),
+      aovBuffers(pSettings),
+      denoiser(pSettings.denoisePasses), display(pSettings)
+  {
+    this->window = window;
+    world = pWorld;
+
+    for (int tile = 0; tile < tileRenderer.tileCount(); ++tile)
+    {
+      primaryHits.push_back(tileRenderer.createTile(tile));
+    }
+    accumulators.resize(primaryHits.size());
+    pixels.resize(settings.width * settings.height);
+
+    windowIndex = -1; // the index of the rendering driver to initialize, or -1 to initialize the first one supporting the requested flags
+    int flags = settings.vsync ? SDL_RENDERER_PRESENTVSYNC : 0;
+    sdl_renderer = SDL_CreateRenderer(window, windowIndex, flags);
+    texture = SDL_CreateTexture(sdl_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, settings.width, settings.height);
+    frameReadyEvent = SDL_RegisterEvents(1);
+
+    if (!settings.savePrefix.empty())
+    {
+      encoder = new ImageEncoder(settings.encoderThreads, settings.encodeQueueSize);
+    }
+  }
+
+  ~Renderer()
+  {
+    cancelRender();
+    delete encoder; // waits for the frames still being written
+    SDL_DestroyTexture(texture);
+  }
+
+  // Starts render() on the render thread, after stopping the one in flight if there is one. Its
+  // tiles run on the shared ThreadPool, at Preview priority when moving. The future becomes
+  // ready once it returns, telling whether it finished (true) or was cancelled (false). Call
+  // from the main thread.
+  std::shared_future<bool> startRender(bool moving = false)
+  {
+    cancelRender();
+
+    if (validTracedStep() == 0 && reprojectedCameraVersion != cameraVersion && !moving)
+    {
+      SDL_SetRenderDrawColor(sdl_renderer, 255, 0, 0, 1); // If something is FULL red on the screen, it means that pixel was not rendered
+      SDL_RenderClear(sdl_renderer);
+      SDL_RenderPresent( sdl_renderer );
+    }
+
+    cancelled = false;
+    presentedSinceStart = false;
+    std::promise<bool> done;
+    std::shared_future<bool> result = done.get_future().share();
+    renderThread = std::thread([this, moving](std::promise<bool> done)
+    {
+      JobScope scope({moving ? JobPriority::Preview : JobPriority::Final, nullptr});
+      render(moving);
+      done.set_value(!cancelled);
+      notifyMainThread();
+    }, std::move(done));
+    return result;
+  }
+
+  // Stops the render in flight at its next tile and waits for it. The world and camera may only
+  // be changed while no render is in flight.
+  void cancelRender()
+  {
+    cancelled = true;
+    if (renderThread.joinable())
+    {
+      renderThread.join();
+    }
+  }
+
+  // Shows the last frame handed over by present(), if it hasn't been shown yet. Call from the
+  // main thread.
+  void showFrame()
+  {
+    frameReadyPending = false;
+    if (!displayBuffers.acquire())
+    {
+      return;
+    }
+
+    SDL_UpdateTexture(texture, NULL, displayBuffers.front().data(), settings.width * sizeof(Uint32));
+    SDL_RenderCopy(sdl_renderer, texture, NULL, NULL);
+    SDL_RenderPresent( sdl_renderer );
+  }
+
+  // Only while no render is in flight, see cancelRender.
+  void setCamera(const Camera& camera)
+  {
+    tileRenderer.camera = camera;
+    cameraVersion++;
+  }
+
+  int validTracedStep() const
+  {
+    return tracedGeometryVersion == world->geometryVersion && tracedCameraVersion == cameraVersion ? tracedStep : 0;
+  }
+
+  // A full quality frame, or with moving and settings.dynamicResolution a quick one, see
+  // renderMotionFrame. Stops early, leaving the frame unfinished, once cancelled is set.
+  void render(bool moving = false)
+  {
+    renderStart = std::chrono::steady_clock::now();
+    tracedStep = validTracedStep();
+    tracedGeometryVersion = world->geometryVersion;
+    tracedCameraVersion = cameraVersion;
+
+    if (moving && settings.dynamicResolution)
+    {
+      renderMotionFrame();
+      return;
+    }
+
+    if (tracedStep != 1)
+    {
+      // Progressive: a quarter of the pixels of every other row and column first (1/16 of the
+      // pixels), then every other pixel of every other row, each shown right away, then the rest.
+      // Every pass only traces the pixels the coarser ones haven't, including those traced by
+      // frames rendered while the view was moving. With settings.timeBudgetMs the passes always
+      // run, and the frame stops at the last one after which the next wouldn't fit the budget.
+      bool budgeted = settings.timeBudgetMs > 0;
+      int previewStep = 0;
+      if (settings.progressive || budgeted)
+      {
+        for (int step : {4, 2})
+        {
+          if (tracedStep != 0 && tracedStep <= step)
+          {
+            continue;
+          }
+          if (budgeted && tracedStep != 0 && !budgetAllows(step))
+          {
+            finishCoarse(previewStep);
+            return;
+          }
+          if (!tracePass(step))
+          {
+            return;
+          }
+          presentPreview(step);
+          previewStep = step;
+        }
+      }
+
+      if (budgeted && tracedStep != 0 && !budgetAllows(1))
+      {
+        finishCoarse(previewStep);
+        return;
+      }
+      if (!tracePass(1))
+      {
+        return;
+      }
+      if (!aovBuffers.aovs.empty())
+      {
+        auto start = std::chrono::steady_clock::now();
+        if (!aovBuffers.save(settings.aovPrefix))
+        {
+          printf("Could not write the AOVs to %s_*.pfm\n", settings.aovPrefix.c_str());
+        }
+        aovSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+    }
+
+    relight();
+  }
+
+  std::chrono::steady_clock::time_point budgetDeadline() const
+  {
+    return renderStart + std::chrono::milliseconds(settings.timeBudgetMs);
+  }
+
+  // Whether tracing the pixels on every step-th row and column that aren't traced yet and
+  // shading each once, plus with step 1 saving the AOVs and finishing the frame, will be done by
+  // the deadline, at the pace of the last pass. Finer passes take a little less per pixel, so
+  // this errs on the safe side.
+  bool budgetAllows(int step) const
+  {
+    double pixels = double(settings.width) * settings.height;
+    double tracedPixels = tracedStep > 0 ? pixels / (tracedStep * tracedStep) : 0;
+    double seconds =
+      (pixels / (step * step) - tracedPixels) * traceSecondsPerPixel +
+      pixels / (step * step) * shadeSecondsPerPixel;
+    if (step == 1)
+    {
+      seconds += (aovBuffers.aovs.empty() ? 0 : aovSeconds) + finishingSeconds();
+    }
+    return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds)) <= budgetDeadline();
+  }
+
+  // The time a full frame takes after sampling: denoising, then writing, presenting, saving and
+  // recording it (see frameFinishSeconds), as long as in the last frame. Before the first, a
+  // denoising pass is taken to be as long as shading one sample of every pixel, which is about
+  // as much work per pixel.
+  double finishingSeconds() const
+  {
+    double seconds = frameFinishSeconds();
+    if (settings.denoisePasses > 0)
+    {
+      double shadeSeconds = double(settings.width) * settings.height * shadeSecondsPerPixel;
+      seconds += denoiseSeconds >= 0 ? denoiseSeconds : settings.denoisePasses * shadeSeconds;
+    }
+    return seconds;
+  }
+
+  // The time writing, presenting, saving and recording a full frame takes, as long as in the
+  // last frame. Before the first, writing and presenting are taken to be as long as for the
+  // last preview, which writes every pixel too, and recording the history, which copies several
+  // values of every pixel, three times as long.
+  double frameFinishSeconds() const
+  {
+    if (finishSeconds >= 0)
+    {
+      return finishSeconds;
+    }
+    return settings.reprojection ? 4 * presentSeconds : presentSeconds;
+  }
+
+  // Ends a render that is out of time with the pixels traced so far: the preview of tracedStep,
+  // already shown if previewStep is the same, is the frame. Without every pixel traced the frame
+  // isn't denoised nor kept as history.
+  void finishCoarse(int previewStep)
+  {
+    if (previewStep != tracedStep)
+    {
+      presentPreview(tracedStep);
+    }
+    if (cancelled)
+    {
+      return;
+    }
+
+    submitFrame();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - renderStart;
+    std::cout << "done, 1 sample per pixel at 1/" << tracedStep << " resolution in " << lround(elapsed.count()) << " ms of a " << settings.timeBudgetMs << " ms budget" << std::endl;
+    if (elapsed.count() > settings.timeBudgetMs)
+    {
+      printf("The time budget is shorter than the coarsest pass takes\n");
+    }
+  }
+
+  // parallelFor whose items are skipped once the render is cancelled. Only for the trace and
+  // sample loops, whose results are dropped when cancelled: denoising, resolving and saving
+  // always run to the end, so that only whole frames are shown, saved and kept as history.
+  template <typename Body>
+  void cancellableFor(int begin, int end, const Body& body)
+  {
+    JobScope scope({currentJob.priority, &cancelled});
+    parallelFor(begin, end, body);
+  }
+
+  // Traces the pixels on every step-th row and column that aren't traced yet. Returns false if
+  // cancelled, in which case tracedStep stays as it was.
+  bool tracePass(int step)
+  {
+    auto start = std::chrono::steady_clock::now();
+    cancellableFor(0, primaryHits.size(), [&](int tile)
+    {
+      tileRenderer.tracePrimaryRays(primaryHits[tile], 0, step, tracedStep);
+      if (step == 1)
+      {
+        aovBuffers.write(primaryHits[tile]);
+      }
+    });
+
+    if (cancelled)
+    {
+      return false;
+    }
+
+    double pixels = double(settings.width) * settings.height;
+    double tracedPixels = pixels / (step * step) - (tracedStep > 0 ? pixels / (tracedStep * tracedStep) : 0);
+    traceSecondsPerPixel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / tracedPixels;
+    tracedStep = step;
+    return true;
+  }
+
+  // A motion frame made from the last frame. Lambert shading doesn't depend on where it is seen
+  // from, so every hit of the last frame keeps its colour wherever it lands in the new view, the
+  // nearest one winning each pixel. Misses land where their direction does, as if the background
+  // were BackgroundDistance away. Only the pixels nothing lands on (disocclusions) and those
+  // along depth edges are traced and shaded, plus one in StaleRefresh of the others, a different
+  // one every frame, which catches surfaces the reprojection got wrong (e.g. coming into view
+  // from the side). Being one of the motion frames, it only runs with settings.dynamicResolution.
+  // Returns false, doing nothing, without a history for the current world and lights or when
+  // more than half the pixels would need tracing, and true, showing nothing, once cancelled.
+  bool reprojectMotionFrame()
+  {
+    const int StaleRefresh = 8;
+
+    bool historyValid =
+      historyObjectId.size() > 0 &&
+      historyGeometryVersion == world->geometryVersion &&
+      historyLightsVersion == world->lightsVersion;
+    if (!historyValid)
+    {
+      return false;
+    }
+
+    int width = settings.width;
+    int height = settings.height;
+    int pixelCount = width * height;
+    const Camera& camera = tileRenderer.camera;
+
+    // where every history point lands in the new view, and in which rows it covers pixels
+    Eigen::ArrayX2d landed(pixelCount, 2);
+    Eigen::ArrayXd distance(pixelCount);
+    std::vector<char> projected(pixelCount, false);
+    cancellableFor(0, height, [&](int y)
+    {
+      for (int i = y * width; i < (y + 1) * width; ++i)
+      {
+        Eigen::Vector2d screen;
+        Eigen::Vector3d position = historyPosition.row(i).transpose();
+        if (camera.project(position, screen))
+        {
+          landed(i, 0) = screen.x() * width;
+          landed(i, 1) = screen.y() * height;
+          distance(i) = (position - camera.pos).norm();
+          projected[i] = true;
+        }
+      }
+    });
+    if (cancelled)
+    {
+      return true;
+    }
+
+    // every point covers the 2x2 pixels around it, so that surfaces coming closer (up to
+    // twice as close) don't spread into a sparse grid with the background showing through.
+    // Each row goes through the points covering it in history order, so that the rows can be
+    // done in parallel.
+    std::vector<std::vector<int>> covering(height);
+    for (int i = 0; i < pixelCount; ++i)
+    {
+      if (!projected[i])
+      {
+        continue;
+      }
+      int top = floor(landed(i, 1));
+      for (int y = std::max(top, 0); y <= std::min(top + 1, height - 1); ++y)
+      {
+        covering[y].push_back(i);
+      }
+    }
+
+    // The nearest surface wins a pixel, and on it the point that landed closest to the pixel.
+    Eigen::ArrayXd depth = Eigen::ArrayXd::Constant(pixelCount, std::numeric_limits<double>::infinity());
+    Eigen::ArrayXi source = Eigen::ArrayXi::Constant(pixelCount, -1); // history pixel landing here
+    Eigen::ArrayXd offset(pixelCount); // how far from the pixel it landed, in pixels squared
+    cancellableFor(0, height, [&](int y)
+    {
+      for (int i : covering[y])
+      {
+        double screenX = landed(i, 0);
+        double screenY = landed(i, 1);
+        int left = floor(screenX);
+        for (int x = std::max(left, 0); x <= std::min(left + 1, width - 1); ++x)
+        {
+          int target = y * width + x;
+          double pixelOffset = (screenX - x) * (screenX - x) + (screenY - y) * (screenY - y);
+          bool nearer =
+            distance(i) < 0.99 * depth(target) ||
+            (distance(i) < 1.01 * depth(target) && pixelOffset < offset(target));
+          if (nearer)
+          {
+            depth(target) = distance(i);
+            source(target) = i;
+            offset(target) = pixelOffset;
+          }
+        }
+      }
+    });
+    if (cancelled)
+    {
+      return true;
+    }
+
+    // The footprints make nearer surfaces grow by up to a pixel, and surfaces coming closer
+    // faster still leave gaps. Both only happen where the depth jumps, trace those pixels again.
+    auto depthEdge = [&](int x, int y)
+    {
+      double d = depth(y * width + x);
+      auto differs = [&](int i) { return std::abs(depth(i) - d) > 0.1 * std::min(depth(i), d); };
+      return
+        (x > 0 && differs(y * width + x - 1)) || (x + 1 < width && differs(y * width + x + 1)) ||
+        (y > 0 && differs((y - 1) * width + x)) || (y + 1 < height && differs((y + 1) * width + x));
+    };
+
+    motionFrames++;
+    std::vector<char> retrace(pixelCount, false);
+    std::vector<int> rowRetraceCount(height, 0);
+    Eigen::ArrayX3d position(pixelCount, 3);
+    Eigen::ArrayXi objectId(pixelCount);
+    Framebuffer color(pixelCount, 4);
+    cancellableFor(0, height, [&](int y)
+    {
+      for (int x = 0; x < width; ++x)
+      {
+        int i = y * width + x;
+        if (source(i) < 0 || depthEdge(x, y) || (mixBits(i) + motionFrames) % StaleRefresh == 0)
+        {
+          retrace[i] = true;
+          rowRetraceCount[y]++;
+        }
+        if (source(i) >= 0)
+        {
+          position.row(i) = historyPosition.row(source(i));
+          objectId(i) = historyObjectId(source(i));
+          color.row(i) = historyColor.row(source(i));
+        }
+      }
+    });
+    if (cancelled)
+    {
+      return true;
+    }
+
+    std::vector<int> retraceRows; // those with pixels to trace
+    int retraceCount = 0;
+    for (int y = 0; y < height; ++y)
+    {
+      if (rowRetraceCount[y] > 0)
+      {
+        retraceRows.push_back(y);
+        retraceCount += rowRetraceCount[y];
+      }
+    }
+    if (2 * retraceCount > pixelCount)
+    {
+      return false;
+    }
+
+    // row by row, in the frame's own pixel coordinates, so that every pixel gets its own samples
+    tileRenderer.integrator->beginFrame();
+    cancellableFor(0, retraceRows.size(), [&](int r)
+    {
+      int y = retraceRows[r];
+      const char* traced = retrace.data() + y * width;
+      GBuffer gbuffer(0, y, width, 1);
+      tileRenderer.traceRowPixels(gbuffer, traced);
+
+      Eigen::ArrayX3d shaded(width, 3);
+      tileRenderer.integrator->shade(gbuffer, 0, shaded);
+
+      for (int x = 0; x < width; ++x)
+      {
+        if (!traced[x])
+        {
+          continue;
+        }
+
+        // a refreshed pixel that still sees the same surface keeps its (converged) colour
+        int i = y * width + x;
+        bool sameSurface =
+          source(i) >= 0 && !depthEdge(x, y) && gbuffer.objectId(x) == objectId(i) &&
+          std::abs(gbuffer.depth(x) - depth(i)) < 0.01 * depth(i);
+        if (sameSurface)
+        {
+          continue;
+        }
+
+        position.row(i) = historyPoint(gbuffer, x, camera.pos);
+        objectId(i) = gbuffer.objectId(x);
+        color.block(i, 0, 1, 3) = (shaded.row(x) / 255).cast<float>();
+        color(i, 3) = 1;
+      }
+    });
+
+    if (cancelled)
+    {
+      return true;
+    }
+
+    for (int y = 0; y < height; ++y)
+    {
+      frame.write(0, y, color.middleRows(y * width, width));
+    }
+    present(frame);
+    reprojectedCameraVersion = cameraVersion;
+
+    historyPosition.swap(position);
+    historyObjectId.swap(objectId);
+    historyColor.swap(color);
+    return true;
+  }
+
+  // Where the history puts what entry i of a G-buffer traced from cameraPos sees.
+  static Eigen::RowVector3d historyPoint(const GBuffer& gbuffer, int i, const Eigen::Vector3d& cameraPos)
+  {
+    if (gbuffer.objectId(i) < 0)
+    {
+      return cameraPos.transpose() + BackgroundDistance * gbuffer.direction.row(i).matrix();
+    }
+    return gbuffer.position.row(i).matrix();
+  }
+
+  // Keeps what every pixel of the finished frame sees and its colour for reprojectMotionFrame.
+  void recordHistory()
+  {
+    int pixelCount = settings.width * settings.height;
+    historyPosition.resize(pixelCount, 3);
+    historyObjectId.resize(pixelCount);
+    historyColor.resize(pixelCount, 4);
+
+    parallelFor(0, primaryHits.size(), [&](int tile)
+    {
+      const GBuffer& gbuffer = primaryHits[tile];
+      Framebuffer row;
+
+      for (int y = 0; y < gbuffer.height; ++y)
+      {
+        int first = (gbuffer.originY + y) * settings.width + gbuffer.originX;
+        frame.read(gbuffer.originX, gbuffer.originY + y, gbuffer.width, row);
+        historyColor.middleRows(first, gbuffer.width) = row;
+        historyObjectId.segment(first, gbuffer.width) = gbuffer.objectId.segment(gbuffer.index(0, y), gbuffer.width);
+        for (int x = 0; x < gbuffer.width; ++x)
+        {
+          historyPosition.row(first + x) = historyPoint(gbuffer, gbuffer.index(x, y), tileRenderer.camera.pos);
+        }
+      }
+    });
+
+    historyGeometryVersion = world->geometryVersion;
+    historyLightsVersion = world->lightsVersion;
+  }
+
+  // While the view keeps changing, frames only trace and shade every motionStep-th pixel of
+  // every motionStep-th row, with one sample, and show them as blocks of the window's size.
+  // motionStep follows the time the frames take to stay within settings.frameBudgetMs: halving
+  // it is four times the pixels. The full quality frame comes once the view stops changing
+  // (see runEventLoop), and reuses the pixels traced here.
+  void renderMotionFrame()
+  {
+    if (settings.reprojection && reprojectMotionFrame())
+    {
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (tracedStep == 0 || tracedStep > motionStep)
+    {
+      if (!tracePass(motionStep))
+      {
+        return;
+      }
+    }
+    presentPreview(motionStep);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (elapsed.count() > settings.frameBudgetMs && motionStep < MaxMotionStep)
+    {
+      motionStep *= 2;
+    }
+    else if (4 * elapsed.count() < 0.75 * settings.frameBudgetMs && motionStep > 1)
+    {
+      motionStep /= 2;
+    }
+  }
+
+  // Re-shades the cached primary hits with the current lights. Only valid while geometry
+  // and camera are unchanged since the last render().
+  void relight()
+  {
+    tileRenderer.integrator->beginFrame();
+    sampleTiles();
+    if (cancelled)
+    {
+      return;
+    }
+
+    auto finishStart = std::chrono::steady_clock::now();
+    long samples = 0;
+    for (int tile = 0; tile < int(primaryHits.size()); ++tile)
+    {
+      const GBuffer& gbuffer = primaryHits[tile];
+      frame.writeTile(gbuffer, accumulators[tile].mean());
+
+      samples += long(accumulators[tile].samples) * gbuffer.width * gbuffer.height;
+    }
+
+    // denoising passes stop in time for the rest of the finish
+    bool budgeted = settings.timeBudgetMs > 0;
+    int denoisePasses = 0;
+    double denoiseElapsed = 0;
+    auto denoiseDeadline = std::chrono::steady_clock::time_point::max();
+    if (budgeted)
+    {
+      denoiseDeadline = budgetDeadline() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(frameFinishSeconds()));
+    }
+    if (settings.denoisePasses > 0 && std::chrono::steady_clock::now() < denoiseDeadline)
+    {
+      auto start = std::chrono::steady_clock::now();
+      denoisePasses = denoiser.denoise(frame, gatherDenoiserGuides(), denoiseDeadline);
+      denoiseElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      denoiseSeconds = denoiseElapsed * settings.denoisePasses / std::max(1, denoisePasses);
+    }
+
+    present(frame);
+    submitFrame();
+    if (settings.reprojection)
+    {
+      recordHistory();
+    }
+    finishSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - finishStart).count() - denoiseElapsed;
+
+    std::cout << "done, " << double(samples) / (settings.width * settings.height) << " samples per pixel on average";
+    if (budgeted)
+    {
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - renderStart;
+      std::cout << " in " << lround(elapsed.count()) << " ms of a " << settings.timeBudgetMs << " ms budget";
+      if (denoisePasses < settings.denoisePasses)
+      {
+        std::cout << ", " << denoisePasses << " of " << settings.denoisePasses << " denoising passes";
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  // Hands the presented frame to the encoder and the video sink, if there are any.
+  void submitFrame()
+  {
+    if (encoder)
+    {
+      saveFrame();
+    }
+    if (video)
+    {
+      video->submit(pixels);
+    }
+  }
+
+  // Hands the presented frame to the encoder, which writes it while the next frame renders.
+  void saveFrame()
+  {
+    encoder->submit(createEncodeJob(settings, savedFrames++, frame, pixels));
+  }
+
+  // Shades one sample of the pixels traced at every step-th column and row and presents each
+  // as a block of step x step pixels.
+  void presentPreview(int step)
+  {
+    tileRenderer.integrator->beginFrame();
+
+    // all the shading first, so that its pace doesn't include filling in the other pixels
+    std::vector<GBuffer> coarse(primaryHits.size(), GBuffer(0, 0, 0, 0));
+    std::vector<Eigen::ArrayX3d> coarseColor(primaryHits.size());
+    auto start = std::chrono::steady_clock::now();
+    cancellableFor(0, primaryHits.size(), [&](int tile)
+    {
+      coarse[tile] = primaryHits[tile].subsample(step);
+      coarseColor[tile].resize(coarse[tile].depth.size(), 3);
+      if (coarse[tile].depth.size() > 0)
+      {
+        tileRenderer.integrator->shade(coarse[tile], 0, coarseColor[tile]);
+      }
+    });
+    if (cancelled)
+    {
+      return;
+    }
+
+    double pixels = double(settings.width) * settings.height / (step * step);
+    shadeSecondsPerPixel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / pixels;
+
+    auto presentStart = std::chrono::steady_clock::now();
+    parallelFor(0, primaryHits.size(), [&](int tile)
+    {
+      if (coarse[tile].depth.size() > 0)
+      {
+        Eigen::ArrayX3d color;
+        TileRenderer::fillCoarse(primaryHits[tile], coarse[tile], step, coarseColor[tile], color);
+        frame.writeTile(primaryHits[tile], color);
+      }
+    });
+    present(frame);
+    presentSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - presentStart).count();
+  }
+
+  // Samples the tiles in rounds (see TileRenderer::nextSampleCount) until every tile is done.
+  // With settings.timeBudgetMs a tile only starts its next round if, at the pace of its earlier
+  // samples, it will be done by the deadline, less finishingSeconds; the image is never left
+  // partly sampled.
+  void sampleTiles()
+  {
+    std::vector<int> activeTiles;
+    for (int tile = 0; tile < int(primaryHits.size()); ++tile)
+    {
+      accumulators[tile].reset(primaryHits[tile].depth.size());
+      activeTiles.push_back(tile);
+    }
+
+    bool budgeted = settings.timeBudgetMs > 0;
+    auto deadline = budgetDeadline() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(finishingSeconds()));
+    std::vector<double> firstSeconds(primaryHits.size(), 0); // spent on each tile's first sample
+    std::vector<double> laterSeconds(primaryHits.size(), 0); // and on its later ones so far
+    std::vector<char> outOfTime(primaryHits.size(), false);
+
+    while (!activeTiles.empty())
+    {
+      if (budgeted)
+      {
+        // the noisiest tiles first, time may run out before the others get their round
+        std::stable_sort(activeTiles.begin(), activeTiles.end(), [&](int a, int b) { return accumulators[a].error() > accumulators[b].error(); });
+      }
+
+      cancellableFor(0, activeTiles.size(), [&](int active)
+      {
+        int tile = activeTiles[active];
+        TileAccumulator& accumulator = accumulators[tile];
+        int targetSamples = tileRenderer.nextSampleCount(accumulator);
+
+        auto start = std::chrono::steady_clock::now();
+        if (budgeted && accumulator.samples > 0)
+        {
+          // the first sample is always taken, so that every pixel has a colour
+          double traceSeconds = primaryHits[tile].depth.size() * traceSecondsPerPixel;
+          double expected = (targetSamples - accumulator.samples) * TileRenderer::secondsPerLaterSample(accumulator.samples, traceSeconds, firstSeconds[tile], laterSeconds[tile]);
+          if (start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(expected)) > deadline)
+          {
+            outOfTime[tile] = true;
+            return;
+          }
+        }
+
+        tileRenderer.sampleTile(primaryHits[tile], accumulator, targetSamples);
+        (targetSamples == 1 ? firstSeconds : laterSeconds)[tile] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      });
+      if (cancelled)
+      {
+        return;
+      }
+
+      std::vector<int> noisyTiles;
+      for (int tile : activeTiles)
+      {
+        if (!outOfTime[tile] && !tileRenderer.tileDone(primaryHits[tile], accumulators[tile]))
+        {
+          noisyTiles.push_back(tile);
+        }
+      }
+      activeTiles.swap(noisyTiles);
+    }
+  }
+
+  // The denoiser's guides, from the cached primary hits and the samples' statistics.
+  DenoiserGuides gatherDenoiserGuides() const
+  {
+    DenoiserGuides guides(settings.width, settings.height);
+
+    parallelFor(0, primaryHits.size(), [&](int tile)
+    {
+      const GBuffer& gbuffer = primaryHits[tile];
+      const TileAccumulator& accumulator = accumulators[tile];
+
+      for (int y = 0; y < gbuffer.height; ++y)
+      {
+        for (int x = 0; x < gbuffer.width; ++x)
+        {
+          int i = gbuffer.index(x, y);
+          int screenX = gbuffer.originX + x;
+          int screenY = gbuffer.originY + y;
+
+          if (accumulator.samples >= 2)
+          {
+            guides.variance(screenY, screenX) = accumulator.luminanceM2(i) / ((accumulator.samples - 1) * accumulator.samples) / (255 * 255);
+          }
+
+          if (gbuffer.objectId(i) < 0)
+          {
+            guides.depth(screenY, screenX) = DenoiserGuides::MissDepth;
+            continue;
+          }
+
+          Eigen::Vector3d normal = gbuffer.normal.row(i).transpose().matrix().normalized();
+          guides.depth(screenY, screenX) = gbuffer.depth(i);
+          for (int c = 0; c < 3; ++c)
+          {
+            guides.normal[c](screenY, screenX) = normal(c);
+            guides.albedo[c](screenY, screenX) = gbuffer.albedo(i, c) / 255;
+          }
+        }
+      }
+    });
+
+    return guides;
+  }
+
+  // Hands the frame over to the main thread, see showFrame. While it is still busy with an
+  // earlier one this frame replaces the one waiting, if any.
+  void present(const FrameStore& color)
+  {
+    display.resolve(color, pixels);
+    displayBuffers.back() = pixels;
+    displayBuffers.publish();
+    presentedSinceStart = true;
+    notifyMainThread();
+  }
+
+  // Queues a frameReadyEvent, unless one is queued already.
+  void notifyMainThread()
+  {
+    if (!frameReadyPending.exchange(true))
+    {
+      SDL_Event event;
+      memset(&event, 0, sizeof(event));
+      event.type = frameReadyEvent;
+      SDL_PushEvent(&event);
+    }
+  }
+};
+
+// Camera and light edits made by input events, kept until the next render starts: the camera and
+// the world may only change while no render is in flight, and the render in flight is left to
+// finish until then.
+struct PendingInput
+{
+  Camera camera; // as it will be
+  Light light;   // the first light of the world, as it will be
+  bool cameraChanged = false;
+  bool lightChanged = false;
+
+  PendingInput(const Camera& pCamera, const Light& pLight)
+    : camera(pCamera), light(pLight)
+  {
+  }
+
+  // Stops the render in flight and hands the edits over to the renderer and the world. Returns
+  // whether the camera moved; if not, the cached primary hits are still valid.
+  bool apply(Renderer& renderer, World& world)
+  {
+    renderer.cancelRender();
+    bool cameraMoved = cameraChanged;
+    if (cameraChanged)
+    {
+      renderer.setCamera(camera);
+    }
+    if (lightChanged)
+    {
+      world.lights[0] = light;
+      world.lightsVersion++;
+    }
+    cameraChanged = false;
+    lightChanged = false;
+    return cameraMoved;
+  }
+};
+
+// Adds the edit of one input event to pending. Returns whether it changed the scene or the view,
+// in which case a new render is needed.
+//   W / S / A / D / Q / E  move the camera forward, back, left, right, down and up
+//   mouse drag, wheel      turn the camera, move it forward and back
+//   arrow keys / page up / page down  move the first light, + / - change its intensity
+bool handleInput(const SDL_Event& event, PendingInput& pending)
+{
+  const double step = 0.25;       // meters per key press
+  const double turnSpeed = 0.2;   // degrees per pixel of mouse motion
+
+  if (event.type == SDL_MOUSEMOTION)
+  {
+    if (!(event.motion.state & SDL_BUTTON_LMASK))
+    {
+      return false;
+    }
+    pending.camera.turn(-event.motion.xrel * turnSpeed, event.motion.yrel * turnSpeed);
+    pending.cameraChanged = true;
+    return true;
+  }
+
+  if (event.type == SDL_MOUSEWHEEL)
+  {
+    pending.camera.move(Eigen::Vector3d(0, 0, -step * event.wheel.y));
+    pending.cameraChanged = true;
+    return true;
+  }
+
+  if (event.type != SDL_KEYDOWN)
+  {
+    return false;
+  }
+
+  Eigen::Vector3d cameraOffset = Eigen::Vector3d::Zero();
+  switch (event.key.keysym.sym) {
+      case SDLK_w: cameraOffset.z() = -step; break;
+      case SDLK_s: cameraOffset.z() = step; break;
+      case SDLK_a: cameraOffset.x() = -step; break;
+      case SDLK_d: cameraOffset.x() = step; break;
+      case SDLK_q: cameraOffset.y() = step; break;
+      case SDLK_e: cameraOffset.y() = -step; break;
+      default: break;
+  }
+
+  if (!cameraOffset.isZero())
+  {
+    pending.camera.move(cameraOffset);
+    pending.cameraChanged = true;
+    return true;
+  }
+
+  // Only the light changes, so the next render is a relight from the cached primary hits.
+  Light& light = pending.light;
+
+  switch (event.key.keysym.sym) {
+      case SDLK_LEFT:     light.pos.x() -= 0.5; break;
+      case SDLK_RIGHT:    light.pos.x() += 0.5; break;
+      case SDLK_UP:       light.pos.y() -= 0.5; break;
+      case SDLK_DOWN:     light.pos.y() += 0.5; break;
+      case SDLK_PAGEUP:   light.pos.z() -= 0.5; break;
+      case SDLK_PAGEDOWN: light.pos.z() += 0.5; break;
+      case SDLK_PLUS:
+      case SDLK_EQUALS:   light.intensity *= 1.25; break;
+      case SDLK_MINUS:    light.intensity /= 1.25; break;
+      default: return false;
+  }
+
+  pending.lightChanged = true;
+  return true;
+}
+
+// The interactive main loop. It sleeps until an event arrives: input is gathered in a
+// PendingInput, finished frames and previews from the render thread get shown. While input
+// keeps coming, the render in flight is only cancelled and restarted with the edits every
+// settings.frameBudgetMs, so that each one has the time to show something instead of being
+// cancelled by the next mouse motion: a render that hasn't presented anything yet is left to run
+// until it does. With settings.dynamicResolution, while the camera moves those are quick frames
+// (Renderer::renderMotionFrame), and the full quality one starts once there has been no input
+// for SettleMs. Light edits alone relight the cached primary hits at full quality right away.
+void runEventLoop(Renderer& renderer, World& world, const RenderSettings& settings)
+{
+  const int SettleMs = 150;
+
+  PendingInput pending(renderer.tileRenderer.camera, world.lights[0]);
+  std::shared_future<bool> job = renderer.startRender();
+  Uint32 lastStart = SDL_GetTicks();
+  bool restart = false;
+  bool settling = false; // the last render was a quick one
+
+  bool is_running = true;
+  while (is_running) {
+      // the render thread sends a frameReadyEvent once the render in flight presents or returns
+      bool running = job.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+      bool awaitingFrame = running && !renderer.presentedSinceStart;
+      SDL_Event event;
+      bool received;
+      if ((restart || settling) && !awaitingFrame) {
+          int delay = restart ? settings.frameBudgetMs : SettleMs;
+          int wait = std::max(0, delay - int(SDL_GetTicks() - lastStart));
+          received = SDL_WaitEventTimeout(&event, wait);
+      }
+      else {
+          received = SDL_WaitEvent(&event);
+      }
+
+      if (received) {
+          if (event.type == SDL_QUIT) {
+              is_running = false;
+          }
+          else if (event.type == renderer.frameReadyEvent) {
+              renderer.showFrame();
+          }
+          else if (handleInput(event, pending)) {
+              restart = true;
+          }
+      }
+
+      int sinceStart = SDL_GetTicks() - lastStart;
+      running = job.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+      if (running && !renderer.presentedSinceStart) {
+          continue;
+      }
+      if (restart && sinceStart >= settings.frameBudgetMs) {
+          bool quick = pending.apply(renderer, world) && settings.dynamicResolution;
+          job = renderer.startRender(quick);
+          lastStart = SDL_GetTicks();
+          restart = false;
+          settling = quick;
+      }
+      else if (settling && !restart && sinceStart >= SettleMs) {
+          job = renderer.startRender();
+          lastStart = SDL_GetTicks();
+          settling = false;
+      }
+  }
+
+  renderer.cancelRender();
+}
+
+RenderSettings parseArguments(int argc, char* argv[])
+{
+  RenderSettings settings;
+  bool samplesGiven = false;
+
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    std::string option = argv[i];
+    std::string value = argv[i + 1];
+
+    if (option == "--resolution")
+    {
+      // WIDTHxHEIGHT
+      int width, height;
+      if (sscanf(value.c_str(), "%dx%d", &width, &height) == 2 && width > 0 && height > 0)
+      {
+        settings.width = width;
+        settings.height = height;
+      }
+      else
+      {
+        printf("Invalid resolution: %s\n", value.c_str());
+      }
+    }
+    else if (option == "--light-samples")
+    {
+      settings.lightSamples = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--light-sampler")
+    {
+      settings.lightSampler = value == "power" ? LightSampler::Power : LightSampler::Tree;
+    }
+    else if (option == "--integrator")
+    {
+      settings.integrator = value == "path" ? IntegratorType::PathTracer : IntegratorType::Direct;
+    }
+    else if (option == "--sampler")
+    {
+      settings.sampler =
+        value == "independent" ? SamplerType::Independent :
+        value == "bluenoise" ? SamplerType::BlueNoise :
+        SamplerType::Sobol;
+    }
+    else if (option == "--spp")
+    {
+      settings.samplesPerPixel = std::max(1, atoi(value.c_str()));
+      samplesGiven = true;
+    }
+    else if (option == "--time-budget")
+    {
+      // Milliseconds per full quality frame (frames shown while the view moves follow
+      // --frame-budget), each --frames frame or the --stream-output image, from its start. The
+      // trace passes, the first sample and the ones after it, the AOV files and denoising all
+      // count. A frame with no time for a full resolution sample ends at a coarser pixel step.
+      // Encoding and writing the saved frames happen alongside, and don't count. Without --spp
+      // tiles sample until the budget runs out, up to BudgetSamplesPerPixel.
+      settings.timeBudgetMs = std::max(0, atoi(value.c_str()));
+    }
+    else if (option == "--adaptive-threshold")
+    {
+      settings.adaptiveThreshold = atof(value.c_str());
+    }
+    else if (option == "--threads")
+    {
+      parallelThreads = std::max(0, atoi(value.c_str()));
+    }
+    else if (option == "--max-depth")
+    {
+      settings.maxDepth = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--exposure")
+    {
+      settings.exposure = atof(value.c_str());
+    }
+    else if (option == "--tone-map")
+    {
+      settings.toneMap =
+        value == "reinhard" ? ToneMap::Reinhard :
+        value == "aces" ? ToneMap::ACES :
+        ToneMap::Clamp;
+    }
+    else if (option == "--output")
+    {
+      settings.srgbOutput = value == "srgb";
+    }
+    else if (option == "--dither")
+    {
+      settings.dither = atoi(value.c_str()) != 0;
+    }
+    else if (option == "--frame-budget")
+    {
+      settings.frameBudgetMs = std::max(0, atoi(value.c_str()));
+    }
+    else if (option == "--dynamic-resolution")
+    {
+      settings.dynamicResolution = atoi(value.c_str()) != 0;
+    }
+    else if (option == "--reprojection")
+    {
+      settings.reprojection = atoi(value.c_str()) != 0;
+    }
+    else if (option == "--vsync")
+    {
+      settings.vsync = atoi(value.c_str()) != 0;
+    }
+    else if (option == "--progressive")
+    {
+      settings.progressive = atoi(value.c_str()) != 0;
+    }
+    else if (option == "--denoise")
+    {
+      settings.denoisePasses = std::max(0, atoi(value.c_str()));
+    }
+    else if (option == "--aovs")
+    {
+      // comma separated names from aovNames
+      std::stringstream names(value);
+      std::string name;
+      while (std::getline(names, name, ','))
+      {
+        int aov = std::find(aovNames, aovNames + int(Aov::Count), name) - aovNames;
+        if (aov < int(Aov::Count))
+        {
+          settings.aovs.push_back(Aov(aov));
+        }
+        else
+        {
+          printf("Unknown AOV: %s\n", name.c_str());
+        }
+      }
+    }
+    else if (option == "--stream-output")
+    {
+      settings.streamPath = value;
+    }
+    else if (option == "--aov-prefix")
+    {
+      settings.aovPrefix = value;
+    }
+    else if (option == "--save")
+    {
+      settings.savePrefix = value;
+    }
+    else if (option == "--save-format")
+    {
+      settings.saveFormat =
+        value == "png" ? ImageFormat::Png :
+        value == "exr" ? ImageFormat::Exr :
+        ImageFormat::Ppm;
+    }
+    else if (option == "--frames")
+    {
+      settings.frames = std::max(0, atoi(value.c_str()));
+    }
+    else if (option == "--animation")
+    {
+      settings.animationPath = value;
+    }
+    else if (option == "--frame-scheduling")
+    {
+      settings.frameScheduling =
+        value == "tiles" ? FrameScheduling::Tiles :
+        value == "frames" ? FrameScheduling::Frames :
+        value == "hybrid" ? FrameScheduling::Hybrid :
+        FrameScheduling::Auto;
+    }
+    else if (option == "--frames-in-flight")
+    {
+      settings.framesInFlight = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--sequence-memory")
+    {
+      settings.sequenceMemoryMB = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--video")
+    {
+      settings.videoPath = value;
+    }
+    else if (option == "--video-format")
+    {
+      settings.videoFormat = value == "rgb" ? VideoFormat::Rgb : VideoFormat::Y4m;
+    }
+    else if (option == "--video-fps")
+    {
+      settings.videoFrameRate = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--encoder-threads")
+    {
+      settings.encoderThreads = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--encode-queue")
+    {
+      settings.encodeQueueSize = std::max(1, atoi(value.c_str()));
+    }
+    else if (option == "--half-float")
+    {
+      settings.halfFloat = atoi(value.c_str()) != 0;
+    }
+    else if (option == "--lights")
+    {
+      settings.sceneLights = atoi(value.c_str());
+    }
+    else if (option == "--environment")
+    {
+      settings.environmentPath = value;
+    }
+    else
+    {
+      printf("Unknown option: %s\n", argv[i]);
+    }
+  }
+
+  if (settings.timeBudgetMs > 0 && settings.samplesPerPixel == 1)
+  {
+    if (samplesGiven)
+    {
+      printf("With --spp 1, --time-budget can only lower the resolution, not the samples\n");
+    }
+    else
+    {
+      // the budget decides when sampling stops
+      settings.samplesPerPixel = BudgetSamplesPerPixel;
+    }
+  }
+
+  return settings;
+}
+
+int main(int argc, char* argv[])
+{
+  RenderSettings settings = parseArguments(argc, argv);
+
+  World world;
+  world.spawnObject();
+  world.spawnLights(settings.sceneLights);
+
+  if (!settings.environmentPath.empty())
+  {
+    world.environment = new EnvironmentMap();
+    if (!world.environment->load(settings.environmentPath))
+    {
+      printf("Could not load environment map: %s\n", settings.environmentPath.c_str());
+      return 1;
+    }
+  }
+
+  if (!settings.streamPath.empty())
+  {
+    if (!streamToFile(world, settings))
+    {
+      printf("Could not write %s\n", settings.streamPath.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
+  VideoSink* video = nullptr;
+  if (!settings.videoPath.empty())
+  {
+    video = new VideoSink(settings);
+    if (!video->open(settings.videoPath))
+    {
+      printf("Could not open video output: %s\n", settings.videoPath.c_str());
+      return 1;
+    }
+  }
+
+  if (settings.frames > 0)
+  {
+    Animation animation = Animation::demo(settings.frames);
+    if (!settings.animationPath.empty() && !animation.load(settings.animationPath))
+    {
+      printf("Could not load animation: %s\n", settings.animationPath.c_str());
+      return 1;
+    }
+
+    if (settings.savePrefix.empty() && settings.videoPath.empty())
+    {
+      settings.savePrefix = "frame";
+    }
+
+    SequenceRenderer sequence(&world, settings, &animation);
+    sequence.video = video;
+    sequence.render();
+    delete video;
+    return 0;
+  }
+
+  SDL_Init(SDL_INIT_VIDEO);
+
+  SDL_Window* window = SDL_CreateWindow(
+      "Raytracer",
+      SDL_WINDOWPOS_CENTERED,
+      SDL_WINDOWPOS_CENTERED,
+      settings.width,
+      settings.height,
+      SDL_WINDOW_MAXIMIZED | SDL_WINDOW_SHOWN
+  );
+
+  if (window == NULL)
+  {
+      printf("Could not create window: %s\n", SDL_GetError());
+      return 1;
+  }
+
+  SDL_Delay(1);
+
+  {
+    // destroyed before the SDL teardown, which its texture needs
+    Renderer render(window, &world, settings);
+    render.video = video;
+    runEventLoop(render, world, settings);
+  }
+  delete video;
 
   SDL_DestroyWindow(window);
   SDL_Quit();